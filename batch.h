@@ -0,0 +1,327 @@
+#pragma once
+
+#include <type_traits>
+#include <utility>
+
+#include "expression.h"
+#include "simd.h"
+
+// Values of one parameter for every row of a ColumnBlock. Bit i of nulls is
+// set when row i does not carry the parameter; nulls may be nullptr.
+struct Column {
+    Expression::PropType type;
+    const void *data;
+    const uint64_t *nulls;
+
+    inline const Expression::PropValInt * Ints() const {
+        return (const Expression::PropValInt *)data;
+    }
+    inline const Expression::PropValFloat * Floats() const {
+        return (const Expression::PropValFloat *)data;
+    }
+    inline const HashCode * Strings() const {
+        return (const HashCode *)data;
+    }
+};
+
+// A struct-of-arrays block of rows. Columns are borrowed, not copied, and
+// string columns hold the code of every value, see Expressions::Code.
+// Parameters without a column are missing from every row.
+//
+// Usage:
+//     ColumnBlock block(1024);
+//     block.Add("price", prices);
+//     block.Add("brand", brand_codes, brand_nulls);
+//     BatchMatcher(exp.Compiled()).Match(block, selection);
+struct ColumnBlock {
+    size_t rows;
+    vector<std::pair<HashCode, Column>> columns;
+
+    inline explicit ColumnBlock(const size_t &rows_) : rows(rows_) {}
+
+    inline size_t Words() const {
+        return (rows + 63) / 64;
+    }
+
+    inline ColumnBlock & Add(const char *name, const Expression::PropValInt *values, const uint64_t *nulls = nullptr) {
+        columns.emplace_back(Hash(name, strlen(name)), Column{Expression::PropInt, values, nulls});
+        return *this;
+    }
+    inline ColumnBlock & Add(const char *name, const Expression::PropValFloat *values, const uint64_t *nulls = nullptr) {
+        columns.emplace_back(Hash(name, strlen(name)), Column{Expression::PropFloat, values, nulls});
+        return *this;
+    }
+    inline ColumnBlock & Add(const char *name, const HashCode *values, const uint64_t *nulls = nullptr) {
+        columns.emplace_back(Hash(name, strlen(name)), Column{Expression::PropString, values, nulls});
+        return *this;
+    }
+
+    inline const Column * Find(const HashCode &name) const {
+        for (const auto &column: columns)
+            if (column.first == name)
+                return &column.second;
+        return nullptr;
+    }
+};
+
+// Evaluates a compiled Program over a whole ColumnBlock: every instruction
+// runs once per block over contiguous columns and produces bitmaps, two per
+// register (defined and true) to keep the three-valued Bool.
+//
+// Jumps become row masks: rows a jump would skip are parked until its target
+// and instructions only write to the rows still active, so results equal the
+// row-at-a-time Match. A block with no active row left jumps for real.
+class BatchMatcher {
+    using Bool = Expression::Bool;
+    using CmpOp = Expression::CmpOp;
+
+    using PropValInt = Expression::PropValInt;
+    using PropValFloat = Expression::PropValFloat;
+
+    const Program &program;
+    Simd::Isa isa;
+
+    size_t words;
+    vector<uint64_t> defined;
+    vector<uint64_t> truth;
+    vector<uint64_t> active;
+    vector<uint64_t> result;
+    // Rows parked by a jump, words each, and the instruction they resume at.
+    // Jumps only go forward, so each parks once per block at most and the
+    // arena holds a row mask per jump.
+    vector<uint64_t> parked;
+    vector<uint32_t> targets;
+
+    template <typename U, typename T, typename B>
+    inline void Compare(const T *a, const CmpOp &op, const B &b, const size_t &rows, uint64_t *out) {
+        Simd::Compare<U>(isa, a, op, b, rows, out);
+    }
+
+    inline void Fill(uint64_t *out, const uint64_t &word) {
+        std::fill(out, out + words, word);
+    }
+
+    inline void Nulls(const Column *column, uint64_t *out) {
+        if (column != nullptr && column->nulls != nullptr)
+            Simd::Or(isa, out, column->nulls, words);
+    }
+
+    // Column <op> constant; rows lacking the value compare True
+    template <typename T>
+    inline void CompareConst(const Column *column, const CmpOp &op, const T &val, const size_t &rows, uint64_t *out);
+
+    inline void CompareColumns(const Column *a, const CmpOp &op, const Column *b, const size_t &rows, uint64_t *out) {
+        if (a == nullptr || b == nullptr)
+            return Fill(out, ~0ULL);
+        if (a->type == Expression::PropString || b->type == Expression::PropString) {
+            if (a->type != b->type)
+                Fill(out, 0);
+            else
+                Compare<HashCode>(a->Strings(), op, b->Strings(), rows, out);
+        } else if (a->type == Expression::PropFloat || b->type == Expression::PropFloat) {
+            if (a->type == Expression::PropFloat && b->type == Expression::PropFloat)
+                Compare<PropValFloat>(a->Floats(), op, b->Floats(), rows, out);
+            else if (a->type == Expression::PropFloat)
+                Compare<PropValFloat>(a->Floats(), op, b->Ints(), rows, out);
+            else
+                Compare<PropValFloat>(a->Ints(), op, b->Floats(), rows, out);
+        } else {
+            Compare<PropValInt>(a->Ints(), op, b->Ints(), rows, out);
+        }
+        Nulls(a, out);
+        Nulls(b, out);
+    }
+
+    // Writes a definite result into register reg for the active rows only
+    inline void Store(const uint16_t &reg, const uint64_t *bits) {
+        Simd::Or(isa, &defined[reg * words], active.data(), words);
+        Simd::Blend(isa, &truth[reg * words], bits, active.data(), words);
+    }
+
+    // bits must be a subset of def
+    inline void Store(const uint16_t &reg, const uint64_t *def, const uint64_t *bits) {
+        Simd::Blend(isa, &defined[reg * words], def, active.data(), words);
+        Simd::Blend(isa, &truth[reg * words], bits, active.data(), words);
+    }
+
+    inline bool Any() const {
+        for (const uint64_t &w: active)
+            if (w != 0)
+                return true;
+        return false;
+    }
+
+public:
+    inline explicit BatchMatcher(const Program &program_) : program(program_), isa(Simd::Detect()), words(0) {}
+
+    // Lowers the kernels this matcher runs; levels above the CPU's are ignored
+    inline BatchMatcher & Use(const Simd::Isa &isa_) {
+        isa = std::min(isa_, Simd::Detect());
+        return *this;
+    }
+
+    // Sets bit i of selection (block.Words() words) for every matching row i
+    void Match(const ColumnBlock &block, uint64_t *selection) {
+        words = block.Words();
+        size_t rows = block.rows;
+        defined.assign(program.registers * words, 0);
+        truth.assign(program.registers * words, 0);
+        active.assign(words, ~0ULL);
+        result.resize(words * 2);
+        size_t jumps = 0;
+        for (const Instruction &ins: program.code)
+            jumps += ins.code == Instruction::JumpFalse || ins.code == Instruction::JumpTrue;
+        parked.resize(jumps * words);
+        targets.clear();
+
+        vector<const Column *> columns;
+        for (const HashCode &name: program.params)
+            columns.push_back(block.Find(name));
+
+        uint64_t *bits = result.data();
+        uint64_t *def = bits + words;
+        const vector<Instruction> &code = program.code;
+        for (uint32_t pc = 0; pc < code.size(); ++pc) {
+            for (size_t i = 0; i < targets.size(); ) {
+                if (targets[i] != pc) {
+                    ++i;
+                    continue;
+                }
+                uint64_t *rows_i = &parked[i * words];
+                for (size_t w = 0; w < words; ++w)
+                    active[w] |= rows_i[w];
+                if (i + 1 != targets.size())
+                    std::copy(parked.data() + (targets.size() - 1) * words, parked.data() + targets.size() * words, rows_i);
+                targets[i] = targets.back();
+                targets.pop_back();
+            }
+            if (!Any()) {
+                if (targets.empty())
+                    break;
+                uint32_t next = *std::min_element(targets.begin(), targets.end());
+                pc = next - 1;
+                continue;
+            }
+
+            const Instruction &ins = code[pc];
+            const uint16_t &dst = ins.dst;
+            if (ins.code < Instruction::CmpFloat) {
+                CompareConst(columns[ins.a], ins.Op(), ins.val_int, rows, bits);
+                Store(dst, bits);
+            } else if (ins.code < Instruction::CmpString) {
+                CompareConst(columns[ins.a], ins.Op(), ins.val_float, rows, bits);
+                Store(dst, bits);
+            } else if (ins.code < Instruction::CmpParam) {
+                CompareConst(columns[ins.a], ins.Op(), ins.val_string, rows, bits);
+                Store(dst, bits);
+            } else if (ins.code < Instruction::CmpBool) {
+                CompareColumns(columns[ins.a], ins.Op(), columns[ins.b], rows, bits);
+                Store(dst, bits);
+            } else if (ins.code < Instruction::Load) {
+                // Bool compares are True when either side is Undefined, and
+                // order False < True otherwise
+                const uint64_t *da = &defined[ins.a * words], *ta = &truth[ins.a * words];
+                const uint64_t *db = &defined[ins.b * words], *tb = &truth[ins.b * words];
+                for (size_t w = 0; w < words; ++w) {
+                    uint64_t cmp = 0;
+                    switch (ins.Op()) {
+                        case Expression::Eq:
+                            cmp = ~(ta[w] ^ tb[w]);
+                            break;
+                        case Expression::Ge:
+                            cmp = ta[w] | ~tb[w];
+                            break;
+                        case Expression::Le:
+                            cmp = ~ta[w] | tb[w];
+                            break;
+                        case Expression::Gt:
+                            cmp = ta[w] & ~tb[w];
+                            break;
+                        case Expression::Lt:
+                            cmp = ~ta[w] & tb[w];
+                            break;
+                        default:
+                            assert(false);
+                    }
+                    bits[w] = ~(da[w] & db[w]) | cmp;
+                }
+                Store(dst, bits);
+            } else if (ins.code == Instruction::RangeInt || ins.code == Instruction::RangeFloat) {
+                CmpOp lo = ins.b & Instruction::LowOpen ? Expression::Gt : Expression::Ge;
+                CmpOp hi = ins.b & Instruction::HighOpen ? Expression::Lt : Expression::Le;
+                if (ins.code == Instruction::RangeInt) {
+                    CompareConst(columns[ins.a], lo, ins.val_int, rows, bits);
+                    CompareConst(columns[ins.a], hi, ins.hi_int, rows, def);
+                } else {
+                    CompareConst(columns[ins.a], lo, ins.val_float, rows, bits);
+                    CompareConst(columns[ins.a], hi, ins.hi_float, rows, def);
+                }
+                Simd::And(isa, bits, def, words);
+                Store(dst, bits);
+            } else if (ins.code == Instruction::Load) {
+                Fill(def, ins.val_bool == Expression::Undefined ? 0 : ~0ULL);
+                Fill(bits, ins.val_bool == Expression::True ? ~0ULL : 0);
+                Store(dst, def, bits);
+            } else if (ins.code == Instruction::And || ins.code == Instruction::Or) {
+                // x && y is False if x is False, else y unless y is Undefined,
+                // else x; || is the same with True deciding
+                const uint64_t *dx = &defined[dst * words], *tx = &truth[dst * words];
+                const uint64_t *dy = &defined[ins.a * words], *ty = &truth[ins.a * words];
+                std::copy(tx, tx + words, bits);
+                Simd::Blend(isa, bits, ty, dy, words);
+                if (ins.code == Instruction::And) {
+                    // def holds the rows x decides False for the moment
+                    std::copy(dx, dx + words, def);
+                    Simd::AndNot(isa, def, tx, words);
+                    Simd::AndNot(isa, bits, def, words);
+                } else {
+                    Simd::Or(isa, bits, tx, words);
+                }
+                std::copy(dx, dx + words, def);
+                Simd::Or(isa, def, dy, words);
+                Store(dst, def, bits);
+            } else {
+                // Park the active rows the jump takes
+                const uint64_t *d = &defined[dst * words], *t = &truth[dst * words];
+                bool on_true = ins.code == Instruction::JumpTrue;
+                assert(ins.target > pc && (targets.size() + 1) * words <= parked.size());
+                uint64_t *taken = parked.data() + targets.size() * words;
+                bool any = false;
+                for (size_t w = 0; w < words; ++w) {
+                    taken[w] = active[w] & d[w] & (on_true ? t[w] : ~t[w]);
+                    active[w] &= ~taken[w];
+                    any = any || taken[w] != 0;
+                }
+                if (any)
+                    targets.push_back(ins.target);
+            }
+        }
+
+        // Rows match unless the result is False
+        const uint64_t *d = &defined[0], *t = &truth[0];
+        for (size_t w = 0; w < words; ++w)
+            selection[w] = ~d[w] | t[w];
+        if (rows % 64 != 0)
+            selection[words - 1] &= (1ULL << (rows % 64)) - 1;
+    }
+};
+
+template <typename T>
+inline void BatchMatcher::CompareConst(const Column *column, const CmpOp &op, const T &val, const size_t &rows, uint64_t *out) {
+    if (column == nullptr)
+        return Fill(out, ~0ULL);
+    bool is_string = std::is_same<T, HashCode>::value;
+    if ((column->type == Expression::PropString) != is_string) {
+        Fill(out, 0);
+    } else if (is_string) {
+        Compare<HashCode>(column->Strings(), op, (HashCode)val, rows, out);
+    } else if (column->type == Expression::PropFloat || std::is_same<T, PropValFloat>::value) {
+        if (column->type == Expression::PropFloat)
+            Compare<PropValFloat>(column->Floats(), op, (PropValFloat)val, rows, out);
+        else
+            Compare<PropValFloat>(column->Ints(), op, (PropValFloat)val, rows, out);
+    } else {
+        Compare<PropValInt>(column->Ints(), op, (PropValInt)val, rows, out);
+    }
+    Nulls(column, out);
+}
@@ -0,0 +1,512 @@
+#include <chrono>
+#include <cerrno>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <unordered_set>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#include "expression.h"
+#include "jit.h"
+#include "saxmatch.h"
+
+// Matching benchmark over a synthetic workload: a rule of a chosen shape and
+// rows of a chosen width, with the per-predicate selectivity solved so the
+// rule matches about the requested fraction of rows. Every engine runs the
+// same rows for warmup rounds and then reps timed rounds, and the results
+// are printed as one JSON object. With --counters on, each result also
+// carries hardware counts per row, see Counters.
+//
+// Usage: ./bench [--op and|or] [--depth n] [--preds n] [--type num|str|mixed]
+//                [--width n] [--strlen n] [--hit f] [--rows n] [--warmup n]
+//                [--reps n] [--seed n] [--engines eval,sax,jit] [--counters on|off]
+//        ./bench hash [count [len]]
+struct Config {
+    std::string op = "and";
+    int depth = 1;
+    int preds = 4;
+    std::string type = "num";
+    int width = 16;
+    int string_len = 16;
+    double hit = 0.1;
+    size_t rows = 100000;
+    int warmup = 1;
+    int reps = 10;
+    uint32_t seed = 42;
+    std::string engines = "eval,sax,jit";
+    bool counters = false;
+
+    bool Parse(int argc, char **argv) {
+        for (int i = 1; i + 1 < argc; i += 2) {
+            std::string key = argv[i], val = argv[i + 1];
+            if (key == "--op")
+                op = val;
+            else if (key == "--depth")
+                depth = std::stoi(val);
+            else if (key == "--preds")
+                preds = std::stoi(val);
+            else if (key == "--type")
+                type = val;
+            else if (key == "--width")
+                width = std::stoi(val);
+            else if (key == "--strlen")
+                string_len = std::stoi(val);
+            else if (key == "--hit")
+                hit = std::stod(val);
+            else if (key == "--rows")
+                rows = std::stoul(val);
+            else if (key == "--warmup")
+                warmup = std::stoi(val);
+            else if (key == "--reps")
+                reps = std::stoi(val);
+            else if (key == "--seed")
+                seed = (uint32_t)std::stoul(val);
+            else if (key == "--engines")
+                engines = val;
+            else if (key == "--counters" && (val == "on" || val == "off"))
+                counters = val == "on";
+            else
+                return false;
+        }
+        return (argc - 1) % 2 == 0 && (op == "and" || op == "or") && rows > 0 && depth > 0 && preds > 0 &&
+               reps > 0 && (type == "num" || type == "str" || type == "mixed") && hit > 0 && hit < 1;
+    }
+
+    inline void Json(std::ostream &w) const {
+        w << "{\"op\": \"" << op << "\", \"depth\": " << depth << ", \"preds\": " << preds
+          << ", \"type\": \"" << type << "\", \"width\": " << std::max(width, preds) << ", \"strlen\": " << string_len
+          << ", \"hit\": " << hit << ", \"rows\": " << rows << ", \"warmup\": " << warmup
+          << ", \"reps\": " << reps << ", \"seed\": " << seed << ", \"counters\": " << (counters ? "true" : "false")
+          << "}";
+    }
+};
+
+// One property of a pre-parsed row, in the interface Expressions::Match reads
+struct Prop {
+    std::string name;
+    Expression::PropType type;
+    std::string str;
+    Expression::PropValInt val;
+
+    inline const char * Name() const {
+        return name.data();
+    }
+    inline size_t NameLen() const {
+        return name.size();
+    }
+    inline Expression::PropType Type() const {
+        return type;
+    }
+    inline const char * String() const {
+        return str.data();
+    }
+    inline size_t ValLen() const {
+        return str.size();
+    }
+    inline Expression::PropValInt Int() const {
+        return val;
+    }
+    inline Expression::PropValFloat Float() const {
+        return (Expression::PropValFloat)val;
+    }
+};
+
+// The rule and rows of a Config. Predicate i reads parameter p<i>: numeric
+// ones are 'p<i> < bound' over values uniform in [0, Range), string ones
+// 'p<i> = literal' where a row holds the literal with the same odds.
+class Workload {
+    static const Expression::PropValInt Range = 1000000;
+
+    const Config &config;
+    std::mt19937 rng;
+    double selectivity;
+    vector<std::string> literals;
+
+    inline bool IsString(const int &pred) const {
+        return config.type == "str" || (config.type == "mixed" && pred % 2 == 1);
+    }
+
+    inline std::string Text(const int &len) {
+        std::string s;
+        for (int i = 0; i < len; ++i)
+            s.push_back((char)('a' + rng() % 26));
+        return s;
+    }
+
+    // Leaves [begin, end) under an op, nesting depth levels with the ops
+    // alternating. Odds of being True, leaves true with odds s, or the text.
+    double Tree(const int &begin, const int &end, const int &depth, const bool &is_and, const double &s,
+                std::ostream *w) {
+        int leaves = end - begin;
+        int kids = depth <= 1 ? leaves : std::max(2, (int)std::lround(std::pow(leaves, 1.0 / depth)));
+        kids = std::min(kids, leaves);
+        double miss = 1;
+        for (int k = 0; k < kids; ++k) {
+            int lo = begin + leaves * k / kids, hi = begin + leaves * (k + 1) / kids;
+            if (w != nullptr && k > 0)
+                *w << (is_and ? " & " : " | ");
+            double p;
+            if (hi - lo == 1) {
+                p = s;
+                if (w != nullptr && IsString(lo))
+                    *w << "p" << lo << " = '" << literals[lo] << "'";
+                else if (w != nullptr)
+                    *w << "p" << lo << " < " << (Expression::PropValInt)(s * Range);
+            } else {
+                if (w != nullptr)
+                    *w << "(";
+                p = Tree(lo, hi, depth - 1, !is_and, s, w);
+                if (w != nullptr)
+                    *w << ")";
+            }
+            miss *= is_and ? p : 1 - p;
+        }
+        return is_and ? miss : 1 - miss;
+    }
+
+public:
+    inline explicit Workload(const Config &config_) : config(config_), rng(config_.seed), selectivity(0.5) {
+        for (int i = 0; i < config.preds; ++i)
+            literals.push_back(Text(config.string_len));
+        // The odds of the rule only grow with those of the leaves
+        double lo = 0, hi = 1;
+        for (int i = 0; i < 60; ++i) {
+            selectivity = (lo + hi) / 2;
+            if (Tree(0, config.preds, config.depth, config.op == "and", selectivity, nullptr) < config.hit)
+                lo = selectivity;
+            else
+                hi = selectivity;
+        }
+    }
+
+    inline double Selectivity() const {
+        return selectivity;
+    }
+
+    inline std::string Rule() {
+        std::ostringstream w;
+        Tree(0, config.preds, config.depth, config.op == "and", selectivity, &w);
+        return w.str();
+    }
+
+    // A row of width properties in random order, the parameters and fillers
+    void Row(vector<Prop> &props, std::string &json) {
+        props.clear();
+        std::uniform_real_distribution<double> odds(0, 1);
+        std::uniform_int_distribution<Expression::PropValInt> value(0, Range - 1);
+        for (int i = 0; i < std::max(config.width, config.preds); ++i) {
+            Prop prop;
+            bool param = i < config.preds;
+            prop.name = (param ? "p" : "f") + std::to_string(param ? i : i - config.preds);
+            if (param ? IsString(i) : i % 2 == 1) {
+                prop.type = Expression::PropString;
+                prop.str = param && odds(rng) < selectivity ? literals[i] : Text(config.string_len);
+            } else {
+                prop.type = Expression::PropInt;
+                prop.val = value(rng);
+            }
+            props.push_back(prop);
+        }
+        std::shuffle(props.begin(), props.end(), rng);
+
+        json = "{";
+        for (const Prop &prop: props) {
+            if (json.size() > 1)
+                json += ", ";
+            json += "\"" + prop.name + "\": ";
+            json += prop.type == Expression::PropString ? "\"" + prop.str + "\"" : std::to_string(prop.val);
+        }
+        json += "}";
+    }
+};
+
+// Hardware counters of the calling thread through perf_event_open, user
+// space only so the default perf_event_paranoid allows them. Every event is
+// opened on its own: one the kernel or CPU does not offer (no PMU in a VM,
+// a seccomp'd container, another OS) stays closed and reports null, and the
+// rest still count. When the PMU has fewer slots than events the kernel
+// multiplexes them, and counts are scaled up by enabled over running time.
+class Counters {
+    static const int Count = 5;
+
+    struct Event {
+        const char *name;
+        uint32_t type;
+        uint64_t config;
+    };
+
+    static const Event * Events() {
+#ifdef __linux__
+        static const Event events[Count] = {
+            {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+            {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+            {"branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+            {"l1d_misses", PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | PERF_COUNT_HW_CACHE_OP_READ << 8 |
+                                                   PERF_COUNT_HW_CACHE_RESULT_MISS << 16},
+            {"llc_misses", PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL | PERF_COUNT_HW_CACHE_OP_READ << 8 |
+                                                   PERF_COUNT_HW_CACHE_RESULT_MISS << 16},
+        };
+#else
+        static const Event events[Count] = {
+            {"cycles", 0, 0}, {"instructions", 0, 0}, {"branch_misses", 0, 0}, {"l1d_misses", 0, 0},
+            {"llc_misses", 0, 0},
+        };
+#endif
+        return events;
+    }
+
+    int fds[Count];
+    double counts[Count];
+    // errno of the first event that failed to open, 0 if none did
+    int error;
+
+public:
+    inline Counters() : error(0) {
+        for (int i = 0; i < Count; ++i) {
+            fds[i] = -1;
+            counts[i] = 0;
+#ifdef __linux__
+            perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = Events()[i].type;
+            attr.config = Events()[i].config;
+            attr.disabled = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            fds[i] = (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+            if (fds[i] < 0 && error == 0)
+                error = errno;
+#else
+            error = ENOSYS;
+#endif
+        }
+    }
+    inline ~Counters() {
+#ifdef __linux__
+        for (int fd: fds)
+            if (fd >= 0)
+                close(fd);
+#endif
+    }
+    Counters(const Counters &) = delete;
+    Counters & operator = (const Counters &) = delete;
+
+    // Whether any event counts; otherwise Error tells why the first failed
+    inline bool Any() const {
+        for (int fd: fds)
+            if (fd >= 0)
+                return true;
+        return false;
+    }
+    inline int Error() const {
+        return error;
+    }
+
+    inline void Start() {
+#ifdef __linux__
+        for (int fd: fds) {
+            if (fd >= 0) {
+                ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+                ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+            }
+        }
+#endif
+    }
+
+    inline void Stop() {
+#ifdef __linux__
+        for (int fd: fds)
+            if (fd >= 0)
+                ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        for (int i = 0; i < Count; ++i) {
+            uint64_t value[3];
+            counts[i] = -1;
+            if (fds[i] < 0 || read(fds[i], value, sizeof(value)) != sizeof(value) || value[2] == 0)
+                continue;
+            counts[i] = (double)value[0] * ((double)value[1] / value[2]);
+        }
+#endif
+    }
+
+    // The counts of the last Start and Stop over per, null where unavailable
+    inline void Json(std::ostream &w, const double &per) const {
+        w << "{";
+        for (int i = 0; i < Count; ++i) {
+            w << (i == 0 ? "" : ", ") << "\"" << Events()[i].name << "\": ";
+            if (fds[i] >= 0 && counts[i] >= 0)
+                w << counts[i] / per;
+            else
+                w << "null";
+        }
+        w << ", \"ipc\": ";
+        if (fds[0] >= 0 && fds[1] >= 0 && counts[0] > 0 && counts[1] >= 0)
+            w << counts[1] / counts[0];
+        else
+            w << "null";
+        w << "}";
+    }
+};
+
+// Times fn over every row index, warmup untimed rounds then reps timed ones,
+// and prints the engine's JSON result. With counters, the timed rounds are
+// counted as well and reported per row.
+template <typename Fn>
+void Run(const char *engine, const Config &config, const size_t &rows, const Fn &fn, Counters *counters,
+         std::ostream &w) {
+    using Clock = std::chrono::steady_clock;
+
+    size_t hits = 0;
+    for (int round = 0; round < config.warmup; ++round)
+        for (size_t i = 0; i < rows; ++i)
+            hits += fn(i);
+
+    vector<double> ns;
+    hits = 0;
+    if (counters != nullptr)
+        counters->Start();
+    for (int round = 0; round < config.reps; ++round) {
+        auto start = Clock::now();
+        for (size_t i = 0; i < rows; ++i)
+            hits += fn(i);
+        ns.push_back(std::chrono::duration<double, std::nano>(Clock::now() - start).count() / rows);
+    }
+    if (counters != nullptr)
+        counters->Stop();
+
+    double mean = 0, var = 0;
+    for (const double &x: ns)
+        mean += x / ns.size();
+    for (const double &x: ns)
+        var += (x - mean) * (x - mean) / std::max<size_t>(1, ns.size() - 1);
+    w << "{\"engine\": \"" << engine << "\", \"ns_per_row\": " << mean << ", \"rows_per_s\": " << 1e9 / mean
+      << ", \"variance\": " << var << ", \"stddev\": " << std::sqrt(var)
+      << ", \"min\": " << *std::min_element(ns.begin(), ns.end())
+      << ", \"max\": " << *std::max_element(ns.begin(), ns.end())
+      << ", \"hit\": " << (double)hits / config.reps / rows;
+    if (counters != nullptr) {
+        w << ", \"counters\": ";
+        counters->Json(w, (double)config.reps * rows);
+    }
+    w << "}";
+}
+
+// Hashes count random values of about len bytes (half to one and a half
+// times len) with each hash policy, several rounds, and reports the best.
+template <typename Policy>
+void HashBench(const char *name, const vector<std::string> &values) {
+    using Clock = std::chrono::steady_clock;
+
+    size_t bytes = 0;
+    for (const std::string &v: values)
+        bytes += v.size();
+
+    double best = 0;
+    HashCode sink = 0;
+    for (int round = 0; round < 5; ++round) {
+        auto start = Clock::now();
+        for (const std::string &v: values)
+            sink += Policy::Hash(v.data(), v.size());
+        double ns = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+        if (round == 0 || ns < best)
+            best = ns;
+    }
+
+    std::unordered_set<HashCode> seen;
+    for (const std::string &v: values)
+        seen.insert(Policy::Hash(v.data(), v.size()));
+
+    std::cout << std::setw(10) << std::left << name << std::right << std::fixed << std::setprecision(2)
+              << std::setw(8) << best / values.size() << " ns/value"
+              << std::setw(8) << bytes / best << " B/ns"
+              << std::setw(8) << values.size() - seen.size() << " collisions"
+              << "  (" << (sink & 1) << ")" << std::endl;
+}
+
+int Hashes(int argc, char **argv) {
+    size_t count = argc > 2 ? strtoul(argv[2], nullptr, 10) : 100000;
+    size_t len = argc > 3 ? strtoul(argv[3], nullptr, 10) : 60;
+
+    std::mt19937 rng(42);
+    vector<std::string> values(count);
+    for (std::string &v: values) {
+        size_t n = len / 2 + rng() % (len + 1);
+        for (size_t i = 0; i < n; ++i)
+            v.push_back((char)(' ' + rng() % 95));
+    }
+
+    std::cout << count << " values of " << len / 2 << ".." << len + len / 2 << " bytes" << std::endl;
+    HashBench<PolyHash>("PolyHash", values);
+    HashBench<WordHash>("WordHash", values);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1 && strcmp(argv[1], "hash") == 0)
+        return Hashes(argc, argv);
+
+    Config config;
+    if (!config.Parse(argc, argv)) {
+        std::cerr << "usage: " << argv[0] << " [--op and|or] [--depth n] [--preds n] [--type num|str|mixed]"
+                  << " [--width n] [--strlen n] [--hit f] [--rows n] [--warmup n] [--reps n] [--seed n]"
+                  << " [--engines eval,sax,jit] [--counters on|off]" << std::endl
+                  << "       " << argv[0] << " hash [count [len]]" << std::endl;
+        return 2;
+    }
+
+    Workload workload(config);
+    std::string rule = workload.Rule();
+    vector<vector<Prop>> rows(config.rows);
+    vector<std::string> json(config.rows);
+    for (size_t i = 0; i < config.rows; ++i)
+        workload.Row(rows[i], json[i]);
+
+    Expressions exp;
+    exp.Parse(rule.c_str());
+    Expressions::Context ctx;
+
+    std::unique_ptr<Counters> counters;
+    if (config.counters) {
+        counters.reset(new Counters());
+        if (!counters->Any()) {
+            std::cerr << "counters unavailable: " << strerror(counters->Error()) << std::endl;
+            counters.reset();
+        }
+    }
+
+    std::ostream &w = std::cout;
+    w << "{\"config\": ";
+    config.Json(w);
+    w << ", \"rule\": \"" << rule << "\", \"selectivity\": " << workload.Selectivity() << ", \"results\": [";
+    const char *sep = "";
+    std::istringstream engines(config.engines);
+    for (std::string engine; std::getline(engines, engine, ','); ) {
+        w << sep;
+        sep = ", ";
+        if (engine == "eval") {
+            Run("eval", config, rows.size(), [&](const size_t &i) { return exp.Match(rows[i], ctx); }, counters.get(), w);
+        } else if (engine == "sax") {
+            SaxMatcher sax(exp);
+            Run("sax", config, rows.size(), [&](const size_t &i) { return sax.Match(json[i].c_str()); }, counters.get(),
+                w);
+        } else if (engine == "jit") {
+            Jit jit(exp.Compiled());
+            Run(jit.Native() ? "jit" : "jit-fallback", config, rows.size(), [&](const size_t &i) {
+                exp.Load(rows[i], ctx);
+                return jit.Run(ctx.slots.data(), ctx.regs.data()).ans != Expression::False;
+            }, counters.get(), w);
+        } else {
+            w << "{\"engine\": \"" << engine << "\", \"error\": \"unknown engine\"}";
+        }
+    }
+    w << "]}" << std::endl;
+    return 0;
+}
@@ -0,0 +1,159 @@
+#pragma once
+
+#include <sstream>
+
+#include "expression.h"
+
+// Opt-in counts of how the predicates of an Expressions come out: for the
+// rule as a whole and for every comparison of its program, how often it was
+// evaluated and came out True, False or Undefined. Comparisons a '&' or '|'
+// skipped are not evaluated, so a predicate that is rarely reached or never
+// decides anything stands out.
+//
+// Counting goes to shards, one per thread: Attach points a Context at a
+// shard and Eval on that Context counts into it, with no atomics or locks.
+// Shards start on cache lines of their own, so threads never write to a
+// line another one counts on. Read merges them into a Snapshot.
+//
+// The counts follow the program as compiled when the PredicateCounters was
+// made; build a new one after Parse or a reordering by Adapt. Shards hold
+// that program only: rows are not counted once it outgrows them, and Read
+// leaves out instructions past them. Read between batches, e.g. once
+// WorkPool::Run returns, for counts that add up. Eval and Match with a
+// Context count, as do SaxMatcher and ParallelMatcher, which then read every
+// row to the end instead of stopping once it is decided.
+//
+// Usage:
+//     PredicateCounters counters(exp, 1);
+//     counters.Attach(ctx, 0);
+//     exp.Match(row, ctx);
+//     PredicateCounters::Snapshot snapshot;
+//     counters.Read(snapshot);
+class PredicateCounters {
+public:
+    // Outcomes of the rule or of one predicate
+    struct Count {
+        uint64_t evals;
+        uint64_t trues;
+        uint64_t falses;
+        uint64_t undefined;
+    };
+
+    struct Predicate {
+        // As the rule reads, parameters by name
+        std::string text;
+        Count count;
+    };
+
+    struct Snapshot {
+        Count rule;
+        vector<Predicate> predicates;
+    };
+
+private:
+    // Stats that fill a whole number of cache lines
+    static const size_t Line = 8;
+    static_assert(Line * sizeof(Program::Stat) % 64 == 0, "a Line of Stats should end on a cache line");
+
+    const Expressions &exp;
+    size_t shards;
+    // Stats per shard: the rule, then every instruction, rounded up to Lines
+    size_t stride;
+    // Shards from the first Stat on a cache line; up to a Line more
+    vector<Program::Stat> storage;
+    Program::Stat *base;
+
+    inline static bool IsPredicate(const Instruction &ins) {
+        return ins.code < Instruction::Load || ins.code == Instruction::RangeInt ||
+               ins.code == Instruction::RangeFloat;
+    }
+
+    std::string Text(const Instruction &ins) const {
+        static const char *ops[] = {" = ", " >= ", " <= ", " > ", " < "};
+        std::ostringstream w;
+        if (ins.code == Instruction::RangeInt || ins.code == Instruction::RangeFloat) {
+            std::string name = exp.Name(ins.a);
+            w << name << (ins.b & Instruction::LowOpen ? " > " : " >= ");
+            if (ins.code == Instruction::RangeInt)
+                w << ins.val_int;
+            else
+                w << ins.val_float;
+            w << " & " << name << (ins.b & Instruction::HighOpen ? " < " : " <= ");
+            if (ins.code == Instruction::RangeInt)
+                w << ins.hi_int;
+            else
+                w << ins.hi_float;
+        } else if (ins.code < Instruction::CmpString) {
+            w << exp.Name(ins.a) << ops[ins.Op()];
+            if (ins.code < Instruction::CmpFloat)
+                w << ins.val_int;
+            else
+                w << ins.val_float;
+        } else if (ins.code < Instruction::CmpParam) {
+            const std::string *bytes = exp.Literals().Bytes(ins.val_string);
+            w << exp.Name(ins.a) << ops[ins.Op()] << "'" << (bytes == nullptr ? "?" : *bytes) << "'";
+        } else if (ins.code < Instruction::CmpBool) {
+            w << exp.Name(ins.a) << ops[ins.Op()] << exp.Name(ins.b);
+        } else {
+            // A comparison of two subexpressions, in register form
+            w << ins;
+        }
+        return w.str();
+    }
+
+    inline static void Add(Count &count, const Program::Stat &stat) {
+        count.evals += stat.evals;
+        count.trues += stat.trues;
+        count.falses += stat.falses;
+        count.undefined = count.evals - count.trues - count.falses;
+    }
+
+public:
+    inline PredicateCounters(const Expressions &exp_, const size_t &shards_) :
+        exp(exp_), shards(std::max<size_t>(1, shards_)) {
+        stride = (1 + exp.Compiled().code.size() + Line - 1) / Line * Line;
+        storage.resize(shards * stride + Line);
+        base = storage.data();
+        while ((uintptr_t)base % 64 != 0)
+            ++base;
+    }
+    PredicateCounters(const PredicateCounters &) = delete;
+    PredicateCounters & operator = (const PredicateCounters &) = delete;
+
+    inline size_t Shards() const {
+        return shards;
+    }
+
+    // Makes Eval on ctx count into a shard, one no other thread counts into
+    inline void Attach(Expressions::Context &ctx, const size_t &shard) {
+        assert(shard < shards);
+        ctx.stats = base + shard * stride;
+        ctx.stat_count = stride;
+    }
+    inline static void Detach(Expressions::Context &ctx) {
+        ctx.stats = nullptr;
+        ctx.stat_count = 0;
+    }
+
+    inline void Clear() {
+        std::fill(storage.begin(), storage.end(), Program::Stat());
+    }
+
+    // Sums the shards. Predicates come in the order the program runs them.
+    void Read(Snapshot &out) const {
+        const vector<Instruction> &code = exp.Compiled().code;
+        size_t counted = std::min(code.size(), stride - 1);
+        out.rule = Count{0, 0, 0, 0};
+        out.predicates.clear();
+        for (size_t s = 0; s < shards; ++s)
+            Add(out.rule, base[s * stride]);
+        for (size_t i = 0; i < counted; ++i) {
+            if (!IsPredicate(code[i]))
+                continue;
+            Predicate predicate{Text(code[i]), Count{0, 0, 0, 0}};
+            for (size_t s = 0; s < shards; ++s)
+                Add(predicate.count, base[s * stride + 1 + i]);
+            out.predicates.push_back(predicate);
+        }
+    }
+};
@@ -1,7 +1,14 @@
 #pragma once
 
+#include <algorithm>
+#include <cassert>
+#include <cctype>
+#include <cstdint>
+#include <cstring>
 #include <iostream>
 #include <string>
+#include <tuple>
+#include <unordered_map>
 #include <vector>
 
 using std::vector;
@@ -9,6 +16,60 @@ using std::ostream;
 using std::abs;
 using HashCode = uint32_t;
 
+// Hash policies for parameter names and string values.
+//
+// PolyHash is the byte-serial 'hash * 131 + c', one multiply per byte in a
+// single dependency chain. WordHash loads eight bytes at a time and mixes
+// each word with one multiply, which is several times faster on long values.
+struct PolyHash {
+    inline static HashCode Hash(const char *str, size_t len) {
+        HashCode hashcode = 0;
+        for (size_t i = 0; i < len; ++i)
+            hashcode = hashcode * 131U + str[i];
+        return hashcode;
+    }
+};
+
+struct WordHash {
+    inline static uint64_t Mix(uint64_t h, const uint64_t &word) {
+        h ^= word * 0x9E3779B97F4A7C15ULL;
+        return ((h << 27) | (h >> 37)) * 0xC2B2AE3D27D4EB4FULL;
+    }
+
+    inline static HashCode Hash(const char *str, size_t len) {
+        uint64_t h = len * 0x165667B19E3779F9ULL, word = 0;
+        size_t i = 0;
+        for (; i + 8 <= len; i += 8) {
+            memcpy(&word, str + i, 8);
+            h = Mix(h, word);
+        }
+        if (i < len) {
+            // The last bytes, read again with the ones before when there are
+            // any, so no load goes past the string
+            if (len >= 8) {
+                memcpy(&word, str + len - 8, 8);
+            } else {
+                word = 0;
+                memcpy(&word, str + i, len - i);
+            }
+            h = Mix(h, word);
+        }
+        h ^= h >> 32;
+        h *= 0x94D049BB133111EBULL;
+        return (HashCode)(h >> 32);
+    }
+};
+
+// The policy every part hashes with, so Parse and Match always agree. Define
+// EXPRESSION_HASH before the first include to pick another one.
+#ifndef EXPRESSION_HASH
+#define EXPRESSION_HASH WordHash
+#endif
+
+inline HashCode Hash(const char *str, size_t len) {
+    return EXPRESSION_HASH::Hash(str, len);
+}
+
 struct Expression {
     using PropType = uint8_t;
     using PropValInt = int32_t;
@@ -201,6 +262,1348 @@ struct Expression {
     }
 };
 
+// A row value bound to one parameter of a compiled Program.
+// type stays PropNone while the row does not carry the parameter.
+struct Slot {
+    Expression::PropType type;
+    union {
+        HashCode val_string;
+        Expression::PropValInt val_int;
+        Expression::PropValFloat val_float;
+    };
+
+    inline Slot(): type(Expression::PropNone), val_int(0) {}
+
+    inline Slot & Assign(const Expression::PropValInt &propValInt) {
+        type = Expression::PropInt;
+        val_int = propValInt;
+        return *this;
+    }
+    inline Slot & Assign(const Expression::PropValFloat &propValFloat) {
+        type = Expression::PropFloat;
+        val_float = propValFloat;
+        return *this;
+    }
+    inline Slot & Assign(const HashCode &hashcode) {
+        type = Expression::PropString;
+        val_string = hashcode;
+        return *this;
+    }
+    inline Slot & Clear() {
+        type = Expression::PropNone;
+        return *this;
+    }
+};
+
+// One step of a compiled Program. Compare codes carry the CmpOp in their low
+// part (e.g. CmpInt + Expression::Ge), so Run dispatches once per step.
+struct Instruction {
+    enum Code : uint8_t {
+        CmpInt = 0,         // regs[dst] = slots[a] <op> val_int
+        CmpFloat = 5,       // regs[dst] = slots[a] <op> val_float
+        CmpString = 10,     // regs[dst] = slots[a] <op> val_string
+        CmpParam = 15,      // regs[dst] = slots[a] <op> slots[b]
+        CmpBool = 20,       // regs[dst] = regs[a] <op> regs[b]
+        Load = 25,          // regs[dst] = val_bool
+        And = 26,           // regs[dst] = regs[dst] && regs[a]
+        Or = 27,            // regs[dst] = regs[dst] || regs[a]
+        JumpFalse = 28,     // goto target if regs[dst] is False
+        JumpTrue = 29,      // goto target if regs[dst] is True
+        RangeInt = 30,      // regs[dst] = val_int <(=) slots[a] <(=) hi_int
+        RangeFloat = 31,    // regs[dst] = val_float <(=) slots[a] <(=) hi_float
+    };
+    // Range flags in b: which of its bounds exclude the constant
+    enum Bounds : uint16_t {
+        LowOpen = 1,
+        HighOpen = 2,
+    };
+
+    uint8_t code;
+    uint16_t dst;
+    uint16_t a;
+    uint16_t b;
+    union {
+        Expression::PropValInt val_int;
+        Expression::PropValFloat val_float;
+        HashCode val_string;
+        Expression::ReturnType val_bool;
+        uint32_t target;
+    };
+    union {
+        Expression::PropValInt hi_int;
+        Expression::PropValFloat hi_float;
+    };
+
+    inline Instruction(const uint8_t &code_, const uint16_t &dst_, const uint16_t &a_ = 0, const uint16_t &b_ = 0) :
+        code(code_), dst(dst_), a(a_), b(b_), val_int(0), hi_int(0) {}
+
+    inline Expression::CmpOp Op() const {
+        return (Expression::CmpOp)(code % 5);
+    }
+
+    inline friend ostream & operator << (ostream &w, const Instruction &ins) {
+        static const std::string ops[] = {"=", ">=", "<=", ">", "<"};
+        static const std::string bls[] = {"Undefined", "False", "True"};
+        if (ins.code == JumpFalse || ins.code == JumpTrue)
+            w << "r" << ins.dst << " is ";
+        else
+            w << "r" << ins.dst << " = ";
+        if (ins.code < CmpParam) {
+            w << "$" << ins.a << " " << ops[ins.Op()] << " ";
+            if (ins.code < CmpFloat)
+                return w << ins.val_int;
+            if (ins.code < CmpString)
+                return w << ins.val_float;
+            return w << "\'" << ins.val_string << "\'";
+        }
+        if (ins.code < CmpBool)
+            return w << "$" << ins.a << " " << ops[ins.Op()] << " $" << ins.b;
+        if (ins.code < Load)
+            return w << "r" << ins.a << " " << ops[ins.Op()] << " r" << ins.b;
+        if (ins.code == Load)
+            return w << bls[ins.val_bool];
+        if (ins.code == JumpFalse || ins.code == JumpTrue)
+            return w << (ins.code == JumpFalse ? "False" : "True") << " ? goto " << ins.target;
+        if (ins.code == RangeInt || ins.code == RangeFloat) {
+            w << "$" << ins.a << (ins.b & LowOpen ? " > " : " >= ");
+            if (ins.code == RangeInt)
+                w << ins.val_int;
+            else
+                w << ins.val_float;
+            w << " & $" << ins.a << (ins.b & HighOpen ? " < " : " <= ");
+            return ins.code == RangeInt ? w << ins.hi_int : w << ins.hi_float;
+        }
+        return w << "r" << ins.dst << (ins.code == And ? " & r" : " | r") << ins.a;
+    }
+};
+
+// The register form of an Expressions: parameters are resolved to dense slots,
+// constants are typed into the instruction, and the operand stack of the RPN
+// becomes a register file, so Run does no per-value type dispatch on the rule.
+//
+// Semantics follow the RPN evaluator it replaces: a comparison on a parameter
+// the row does not carry is True, a string compared with a number is False,
+// ints compare as floats against floats, and a bare parameter or constant used
+// as a boolean is Undefined.
+class Program {
+    using Bool = Expression::Bool;
+    using CmpOp = Expression::CmpOp;
+
+    using PropValInt = Expression::PropValInt;
+    using PropValFloat = Expression::PropValFloat;
+
+    struct Node {
+        Expression exp;
+        // Two operands for a comparison, any number for '&' and '|'
+        vector<int> kids;
+        // An '&' of a lower and an upper bound on one parameter
+        bool range;
+        // Always True or False, never Undefined; see Definite
+        bool definite;
+        // Hash of the subtree as written, see Shape
+        uint64_t shape;
+
+        inline explicit Node(const Expression &exp_, const vector<int> &kids_ = vector<int>()) :
+            exp(exp_), kids(kids_), range(false), shape(0) {
+            definite = IsConst() ? exp.val_bool.ans != Expression::Undefined : IsOp() && !IsLogic();
+        }
+
+        inline bool IsOp() const {
+            return exp.type == Expression::PropOp;
+        }
+        inline bool IsLogic() const {
+            return IsOp() && (exp.cmp_op == Expression::And || exp.cmp_op == Expression::Or);
+        }
+        // A subtree folded to a Bool
+        inline bool IsConst() const {
+            return exp.type == Expression::PropBool;
+        }
+        // A parameter or a literal
+        inline bool IsValue() const {
+            return !IsOp() && !IsConst();
+        }
+    };
+
+    vector<Node> nodes;
+    // Whether Simplify may fuse bounds into Range instructions
+    bool fuse;
+    // Node to emit, -1 for an empty expression
+    int root;
+    // Node each instruction evaluates, -1 for the glue between them
+    vector<int> origin;
+
+    // Name hash -> slot table, open-addressed over (name * seed) >> shift.
+    // Compile looks for a seed without collisions, so a lookup is normally a
+    // single probe; linear probing keeps it correct when none is found.
+    struct Entry {
+        HashCode name;
+        uint16_t slot;
+    };
+    static const uint16_t Empty = 0xFFFF;
+
+    vector<Entry> table;
+    uint32_t seed;
+    uint32_t shift;
+
+    inline uint32_t Bucket(const HashCode &name) const {
+        return (uint32_t)(name * seed) >> shift;
+    }
+
+    inline bool Place(const uint32_t &bits, const uint32_t &seed_, const bool &probe) {
+        table.assign((size_t)1 << bits, Entry{0, Empty});
+        seed = seed_;
+        shift = 32 - bits;
+        for (size_t i = 0; i < params.size(); ++i) {
+            uint32_t b = Bucket(params[i]);
+            while (table[b].slot != Empty) {
+                if (!probe)
+                    return false;
+                b = (b + 1) & (uint32_t)(table.size() - 1);
+            }
+            table[b] = Entry{params[i], (uint16_t)i};
+        }
+        return true;
+    }
+
+    inline void BuildTable() {
+        uint32_t bits = 1;
+        while (((size_t)1 << bits) < params.size() * 2)
+            ++bits;
+        for (uint32_t grow = 0; grow < 3; ++grow, ++bits)
+            for (uint32_t attempt = 0; attempt < 64; ++attempt)
+                if (Place(bits, (0x9E3779B1U + attempt * 0x632BE5A6U) | 1U, false))
+                    return;
+        Place(bits, 0x9E3779B1U, true);
+    }
+
+    template <typename T>
+    inline static bool Cmp(const T &a, const CmpOp &op, const T &b) {
+        switch (op) {
+            case Expression::Eq:
+                return a == b;
+            case Expression::Ge:
+                return b <= a;
+            case Expression::Le:
+                return a <= b;
+            case Expression::Gt:
+                return b < a;
+            case Expression::Lt:
+                return a < b;
+            default:
+                assert(false);
+        }
+        return false;
+    }
+
+    inline static CmpOp Swap(const CmpOp &op) {
+        switch (op) {
+            case Expression::Ge:
+                return Expression::Le;
+            case Expression::Le:
+                return Expression::Ge;
+            case Expression::Gt:
+                return Expression::Lt;
+            case Expression::Lt:
+                return Expression::Gt;
+            default:
+                return op;
+        }
+    }
+
+    inline static Slot ToSlot(const Expression &exp) {
+        Slot slot;
+        if (exp.type == Expression::PropInt)
+            slot.Assign(exp.val_int);
+        else if (exp.type == Expression::PropFloat)
+            slot.Assign(exp.val_float);
+        else if (exp.type == Expression::PropString)
+            slot.Assign(exp.val_string);
+        return slot;
+    }
+
+    inline uint16_t Param(const HashCode &name) {
+        auto it = std::find(params.begin(), params.end(), name);
+        if (it != params.end())
+            return (uint16_t)(it - params.begin());
+        assert(params.size() < 0xFFFF);
+        params.push_back(name);
+        return (uint16_t)(params.size() - 1);
+    }
+
+    inline void Emit(const Instruction &ins) {
+        code.push_back(ins);
+        origin.push_back(-1);
+        if (ins.dst >= registers)
+            registers = ins.dst + 1U;
+    }
+
+    inline void EmitLoad(const uint16_t &reg, const Expression::ReturnType &ans) {
+        Instruction ins(Instruction::Load, reg);
+        ins.val_bool = ans;
+        Emit(ins);
+    }
+
+    inline void EmitCompare(const Expression &lhs, const CmpOp &op, const Expression &rhs, const uint16_t &reg) {
+        bool lhs_param = lhs.type == Expression::PropParameter;
+        bool rhs_param = rhs.type == Expression::PropParameter;
+        if (lhs_param && rhs_param) {
+            Emit(Instruction(Instruction::CmpParam + op, reg, Param(lhs.name), Param(rhs.name)));
+        } else if (lhs_param || rhs_param) {
+            const Expression &param = lhs_param ? lhs : rhs;
+            const Expression &constant = lhs_param ? rhs : lhs;
+            CmpOp cmp = lhs_param ? op : Swap(op);
+            if (constant.type == Expression::PropInt) {
+                Instruction ins(Instruction::CmpInt + cmp, reg, Param(param.name));
+                ins.val_int = constant.val_int;
+                Emit(ins);
+            } else if (constant.type == Expression::PropFloat) {
+                Instruction ins(Instruction::CmpFloat + cmp, reg, Param(param.name));
+                ins.val_float = constant.val_float;
+                Emit(ins);
+            } else {
+                Instruction ins(Instruction::CmpString + cmp, reg, Param(param.name));
+                ins.val_string = constant.val_string;
+                Emit(ins);
+            }
+        } else {
+            EmitLoad(reg, Compare(ToSlot(lhs), op, ToSlot(rhs)).ans);
+        }
+    }
+
+    inline int Const(const Expression::ReturnType &ans) {
+        Expression exp;
+        nodes.emplace_back(exp.AssignBool(Bool(ans)));
+        Shape((int)nodes.size() - 1);
+        return (int)nodes.size() - 1;
+    }
+
+    // Hashes a node from its own value and the shapes of its kids, which are
+    // final by then, so subtrees Same calls equal get equal shapes
+    inline void Shape(const int &idx) {
+        Node &node = nodes[idx];
+        uint64_t h = (uint64_t)node.exp.type << 1 | node.range;
+        uint64_t val = 0;
+        switch (node.exp.type) {
+            case Expression::PropOp:
+                val = (uint64_t)node.exp.cmp_op;
+                break;
+            case Expression::PropParameter:
+                val = node.exp.name;
+                break;
+            case Expression::PropInt:
+                val = (uint32_t)node.exp.val_int;
+                break;
+            case Expression::PropFloat: {
+                // +0.0 for -0.0, which compares equal
+                PropValFloat f = node.exp.val_float + (PropValFloat)0;
+                uint32_t bits;
+                memcpy(&bits, &f, sizeof(bits));
+                val = bits;
+                break;
+            }
+            case Expression::PropString:
+                val = node.exp.val_string;
+                break;
+            default:
+                val = (uint64_t)node.exp.val_bool.ans;
+        }
+        h = (h ^ val) * 0x9E3779B97F4A7C15ULL;
+        for (const int &kid: node.kids)
+            h = (h ^ h >> 29 ^ nodes[kid].shape) * 0xBF58476D1CE4E5B9ULL;
+        node.shape = h ^ h >> 32;
+    }
+
+    // Whether two subtrees are written the same, without recursing on deep
+    // ones
+    inline bool Same(const int &x, const int &y) const {
+        vector<std::pair<int, int>> pending{{x, y}};
+        while (!pending.empty()) {
+            const Node &a = nodes[pending.back().first], &b = nodes[pending.back().second];
+            pending.pop_back();
+            if (&a == &b)
+                continue;
+            if (a.shape != b.shape || a.exp.type != b.exp.type || a.range != b.range ||
+                a.kids.size() != b.kids.size())
+                return false;
+            bool same;
+            switch (a.exp.type) {
+                case Expression::PropOp:
+                    same = a.exp.cmp_op == b.exp.cmp_op;
+                    break;
+                case Expression::PropParameter:
+                    same = a.exp.name == b.exp.name;
+                    break;
+                case Expression::PropInt:
+                    same = a.exp.val_int == b.exp.val_int;
+                    break;
+                case Expression::PropFloat:
+                    same = a.exp.val_float == b.exp.val_float;
+                    break;
+                case Expression::PropString:
+                    same = a.exp.val_string == b.exp.val_string;
+                    break;
+                default:
+                    same = a.exp.val_bool.ans == b.exp.val_bool.ans;
+            }
+            if (!same)
+                return false;
+            for (size_t i = 0; i < a.kids.size(); ++i)
+                pending.emplace_back(a.kids[i], b.kids[i]);
+        }
+        return true;
+    }
+
+    // Whether a node is 'param >=, >, <= or < number', and which side it bounds
+    inline bool Bound(const int &idx, bool &lower) const {
+        const Node &node = nodes[idx];
+        if (!node.IsOp() || node.IsLogic() || node.exp.cmp_op == Expression::Eq)
+            return false;
+        const Expression &param = nodes[node.kids[0]].exp;
+        const Expression &val = nodes[node.kids[1]].exp;
+        if (param.type != Expression::PropParameter)
+            return false;
+        if (val.type != Expression::PropInt && val.type != Expression::PropFloat)
+            return false;
+        lower = node.exp.cmp_op == Expression::Ge || node.exp.cmp_op == Expression::Gt;
+        return true;
+    }
+
+    // Equal for bounds on one side that read the same parameter against the
+    // same constant type
+    inline uint64_t Side(const int &idx, const bool &lower) const {
+        const Node &node = nodes[idx];
+        return (uint64_t)nodes[node.kids[0]].exp.name << 32 | (uint64_t)nodes[node.kids[1]].exp.type << 1 | lower;
+    }
+
+    // 1 if bound x excludes more than bound y of the same side, -1 if less, 0
+    // when it depends on the row: distinct int constants may meet as floats
+    inline int Order(const int &x, const int &y, const bool &lower) const {
+        const Node &a = nodes[x], &b = nodes[y];
+        const Expression &va = nodes[a.kids[1]].exp, &vb = nodes[b.kids[1]].exp;
+        bool strict_a = a.exp.cmp_op == Expression::Gt || a.exp.cmp_op == Expression::Lt;
+        bool strict_b = b.exp.cmp_op == Expression::Gt || b.exp.cmp_op == Expression::Lt;
+        PropValFloat fa = va.type == Expression::PropInt ? (PropValFloat)va.val_int : va.val_float;
+        PropValFloat fb = vb.type == Expression::PropInt ? (PropValFloat)vb.val_int : vb.val_float;
+        if (fa == fb) {
+            if (va.type == Expression::PropInt && va.val_int != vb.val_int)
+                return 0;
+            return strict_a == strict_b ? 0 : (strict_a ? 1 : -1);
+        }
+        return (fa > fb) == lower ? 1 : -1;
+    }
+
+    // Folds constant subtrees, flattens and dedupes '&' and '|' and merges
+    // bounds, keeping the result of every row. Returns the node to emit for
+    // idx, whose kids were simplified into simple. An '&' or '|' chained
+    // under the same op is left for the top of its chain, which flattens the
+    // whole chain once, so long chains simplify in linear time. Since a
+    // comparison on a missing parameter is True, contradicting bounds such
+    // as 'x > 7 & x < 5' are not False and stay.
+    int Simplify(const int &idx, const vector<int> &simple, const vector<bool> &chained) {
+        if (!nodes[idx].IsOp()) {
+            Shape(idx);
+            return idx;
+        }
+        vector<int> kids;
+        for (const int &kid: nodes[idx].kids)
+            kids.push_back(simple[kid]);
+        CmpOp op = nodes[idx].exp.cmp_op;
+
+        if (!nodes[idx].IsLogic()) {
+            const Node &lhs = nodes[kids[0]], &rhs = nodes[kids[1]];
+            if (lhs.IsValue() && rhs.IsValue()) {
+                bool lhs_param = lhs.exp.type == Expression::PropParameter;
+                bool rhs_param = rhs.exp.type == Expression::PropParameter;
+                if (!lhs_param && !rhs_param)
+                    return Const(Compare(ToSlot(lhs.exp), op, ToSlot(rhs.exp)).ans);
+                // Parameter first, so equal comparisons are written the same
+                if (!lhs_param) {
+                    std::swap(kids[0], kids[1]);
+                    nodes[idx].exp.cmp_op = Swap(op);
+                }
+            } else if (lhs.IsValue() || rhs.IsValue()) {
+                // A bare value is Undefined as a Bool, which compares True
+                return Const(Expression::True);
+            } else if (lhs.IsConst() && rhs.IsConst()) {
+                return Const(Compare(lhs.exp.val_bool, op, rhs.exp.val_bool).ans);
+            }
+            nodes[idx].kids = kids;
+            Shape(idx);
+            return idx;
+        }
+        if (chained[idx]) {
+            nodes[idx].kids = kids;
+            return idx;
+        }
+
+        bool is_and = op == Expression::And;
+        Expression::ReturnType decides = is_and ? Expression::False : Expression::True;
+        bool neutral = false;
+        vector<int> group;
+        std::unordered_multimap<uint64_t, int> shapes;
+        vector<int> pending(kids.rbegin(), kids.rend());
+        while (!pending.empty()) {
+            int idx_kid = pending.back();
+            pending.pop_back();
+            const Node &kid = nodes[idx_kid];
+            if (kid.IsLogic() && kid.exp.cmp_op == op) {
+                pending.insert(pending.end(), kid.kids.rbegin(), kid.kids.rend());
+                continue;
+            }
+            // Undefined operands never change an '&' or '|'
+            if (kid.IsValue() || (kid.IsConst() && kid.exp.val_bool.ans == Expression::Undefined))
+                continue;
+            if (kid.IsConst()) {
+                if (kid.exp.val_bool.ans == decides)
+                    return Const(decides);
+                neutral = true;
+                continue;
+            }
+            bool seen = false;
+            auto same = shapes.equal_range(kid.shape);
+            for (auto it = same.first; it != same.second && !seen; ++it)
+                seen = Same(it->second, idx_kid);
+            if (!seen) {
+                shapes.emplace(kid.shape, idx_kid);
+                group.push_back(idx_kid);
+            }
+        }
+
+        // Of the bounds on one side of a parameter '&' keeps the tightest and
+        // '|' the loosest; ones that compare either way depending on the row
+        // stay. Dropped operands are marked -1.
+        std::unordered_map<uint64_t, size_t> kept;
+        for (size_t i = 0; i < group.size(); ++i) {
+            bool lower;
+            if (!Bound(group[i], lower))
+                continue;
+            auto first = kept.emplace(Side(group[i], lower), i);
+            if (first.second)
+                continue;
+            int &other = group[first.first->second];
+            int order = Order(group[i], other, lower);
+            if (order == 0)
+                continue;
+            if ((order > 0) == is_and)
+                other = group[i];
+            group[i] = -1;
+        }
+        // and the two sides left of one parameter make a range, where the
+        // first of them was
+        std::unordered_map<uint64_t, size_t> open;
+        for (size_t i = 0; fuse && is_and && i < group.size(); ++i) {
+            bool lower;
+            if (group[i] < 0 || !Bound(group[i], lower))
+                continue;
+            auto match = open.find(Side(group[i], !lower));
+            if (match == open.end()) {
+                open.emplace(Side(group[i], lower), i);
+                continue;
+            }
+            int &other = group[match->second];
+            nodes.emplace_back(nodes[idx].exp, lower ? vector<int>{group[i], other} : vector<int>{other, group[i]});
+            nodes.back().range = true;
+            nodes.back().definite = true;
+            Shape((int)nodes.size() - 1);
+            other = (int)nodes.size() - 1;
+            group[i] = -1;
+            open.erase(match);
+        }
+        group.erase(std::remove(group.begin(), group.end(), -1), group.end());
+
+        // A True operand of '&' (False of '|') only matters when the others
+        // may all be Undefined
+        if (neutral) {
+            bool definite = false;
+            for (const int &kid: group)
+                definite = definite || Definite(kid);
+            if (!definite)
+                group.push_back(Const(is_and ? Expression::True : Expression::False));
+        }
+        if (group.empty())
+            return Const(Expression::Undefined);
+        if (group.size() == 1)
+            return group[0];
+        nodes[idx].kids = group;
+        for (const int &kid: group)
+            nodes[idx].definite = nodes[idx].definite || Definite(kid);
+        Shape(idx);
+        return idx;
+    }
+
+    // Whether a node always evaluates to True or False, never Undefined: a
+    // comparison, a True or False constant, or an '&' or '|' with such an
+    // operand
+    inline bool Definite(const int &idx) const {
+        return nodes[idx].definite;
+    }
+
+    // Chained '&'s or '|'s jump onto each other's tests of the same register;
+    // the first jump can go straight to the final target.
+    inline void Thread() {
+        for (Instruction &ins: code) {
+            if (ins.code != Instruction::JumpFalse && ins.code != Instruction::JumpTrue)
+                continue;
+            while (ins.target < code.size()) {
+                const Instruction &next = code[ins.target];
+                if (next.dst != ins.dst || (next.code != Instruction::JumpFalse && next.code != Instruction::JumpTrue))
+                    break;
+                ins.target = next.code == ins.code ? next.target : ins.target + 1;
+            }
+        }
+    }
+
+    inline void EmitRange(const Node &lower, const Node &upper, const uint16_t &reg) {
+        const Expression &lo = nodes[lower.kids[1]].exp, &hi = nodes[upper.kids[1]].exp;
+        uint16_t open = 0;
+        if (lower.exp.cmp_op == Expression::Gt)
+            open |= Instruction::LowOpen;
+        if (upper.exp.cmp_op == Expression::Lt)
+            open |= Instruction::HighOpen;
+        uint16_t slot = Param(nodes[lower.kids[0]].exp.name);
+        if (lo.type == Expression::PropInt) {
+            Instruction ins(Instruction::RangeInt, reg, slot, open);
+            ins.val_int = lo.val_int;
+            ins.hi_int = hi.val_int;
+            Emit(ins);
+        } else {
+            Instruction ins(Instruction::RangeFloat, reg, slot, open);
+            ins.val_float = lo.val_float;
+            ins.hi_float = hi.val_float;
+            Emit(ins);
+        }
+    }
+
+    inline void EmitNode(const int &idx, const uint16_t &reg) {
+        assert(reg < 0xFFFF);
+        const Node &node = nodes[idx];
+        if (!node.IsOp()) {
+            EmitLoad(reg, node.IsConst() ? node.exp.val_bool.ans : Expression::Undefined);
+            origin.back() = idx;
+            return;
+        }
+        const Node &lhs = nodes[node.kids[0]];
+        const Node &rhs = nodes[node.kids[1]];
+        if (node.range) {
+            EmitRange(lhs, rhs, reg);
+            origin.back() = idx;
+        } else if (node.IsLogic()) {
+            // A False operand decides '&' and a True one decides '|'. Otherwise
+            // the result is the next operand, or the ones before when it is
+            // Undefined, so a Definite operand may overwrite reg in place.
+            bool is_and = node.exp.cmp_op == Expression::And;
+            vector<size_t> jumps;
+            EmitNode(node.kids[0], reg);
+            for (size_t i = 1; i < node.kids.size(); ++i) {
+                jumps.push_back(code.size());
+                Emit(Instruction(is_and ? Instruction::JumpFalse : Instruction::JumpTrue, reg));
+                if (Definite(node.kids[i])) {
+                    EmitNode(node.kids[i], reg);
+                } else {
+                    EmitNode(node.kids[i], reg + 1);
+                    Emit(Instruction(is_and ? Instruction::And : Instruction::Or, reg, reg + 1));
+                }
+            }
+            for (const size_t &jump: jumps)
+                code[jump].target = (uint32_t)code.size();
+        } else if (lhs.IsValue() && rhs.IsValue()) {
+            EmitCompare(lhs.exp, node.exp.cmp_op, rhs.exp, reg);
+            origin.back() = idx;
+        } else {
+            EmitNode(node.kids[0], reg);
+            EmitNode(node.kids[1], reg + 1);
+            Emit(Instruction(Instruction::CmpBool + node.exp.cmp_op, reg, reg, reg + 1));
+            origin.back() = idx;
+        }
+    }
+
+    // Expected cost of a subtree per evaluation, in compares, and how often
+    // it comes out True and False
+    struct Estimate {
+        double cost;
+        double trues;
+        double falses;
+    };
+
+    // Sorts the operands of an '&' by cost over the odds of being False, and
+    // of an '|' by cost over the odds of being True: the order that
+    // short-circuits cheapest for independent operands. Both are associative
+    // and commutative over the three-valued Bool, so any order gives the
+    // same results. The kids of idx are ranked before, into ranked.
+    Estimate Rank(const int &idx, const vector<Estimate> &ranked) {
+        const Node &node = nodes[idx];
+        const Stat &seen = history[idx];
+        Estimate est{0.5, 0.5, 0.5};
+        if (!node.IsOp()) {
+            est.trues = node.IsConst() && node.exp.val_bool.ans == Expression::True ? 1 : 0;
+            est.falses = node.IsConst() && node.exp.val_bool.ans == Expression::False ? 1 : 0;
+            return est;
+        }
+        // A range is one instruction with statistics of its own, though an
+        // '&' of two bounds
+        if (!node.IsLogic() || node.range) {
+            bool values = nodes[node.kids[0]].IsValue() && nodes[node.kids[1]].IsValue();
+            if (node.range || (values && nodes[node.kids[1]].exp.type == Expression::PropParameter))
+                est.cost = 2;
+            else if (values)
+                est.cost = 1;
+            else
+                est.cost = 1 + ranked[node.kids[0]].cost + ranked[node.kids[1]].cost;
+            if (seen.evals > 0) {
+                est.trues = (double)seen.trues / seen.evals;
+                est.falses = (double)seen.falses / seen.evals;
+            }
+            return est;
+        }
+
+        bool is_and = node.exp.cmp_op == Expression::And;
+        vector<std::pair<double, int>> order;
+        vector<Estimate> kids;
+        for (const int &kid: node.kids) {
+            kids.push_back(ranked[kid]);
+            double decides = is_and ? kids.back().falses : kids.back().trues;
+            double key = decides > 0 ? kids.back().cost / decides : 1e300;
+            order.emplace_back(key, (int)order.size());
+        }
+        std::stable_sort(order.begin(), order.end(),
+                         [](const std::pair<double, int> &a, const std::pair<double, int> &b) { return a.first < b.first; });
+
+        vector<int> sorted;
+        double reach = 1, undefined = 1;
+        est.cost = 0;
+        for (const auto &o: order) {
+            const Estimate &kid = kids[o.second];
+            sorted.push_back(node.kids[o.second]);
+            est.cost += reach * (kid.cost + 1);
+            reach *= 1 - (is_and ? kid.falses : kid.trues);
+            undefined *= std::max(0.0, 1 - kid.trues - kid.falses);
+        }
+        nodes[idx].kids = sorted;
+        if (is_and) {
+            est.falses = 1 - reach;
+            est.trues = std::max(0.0, reach - undefined);
+        } else {
+            est.trues = 1 - reach;
+            est.falses = std::max(0.0, reach - undefined);
+        }
+        return est;
+    }
+
+    inline void Emit() {
+        code.clear();
+        origin.clear();
+        registers = 1;
+        if (root < 0)
+            EmitLoad(0, Expression::Undefined);
+        else
+            EmitNode(root, 0);
+        Thread();
+        Outline();
+    }
+
+public:
+    // How often an instruction ran and came out True or False
+    struct Stat {
+        uint64_t evals;
+        uint64_t trues;
+        uint64_t falses;
+
+        inline Stat(): evals(0), trues(0), falses(0) {}
+    };
+
+private:
+    // Outcomes per node, as of the last Reorder
+    vector<Stat> history;
+
+public:
+    vector<Instruction> code;
+    // Parameter name hash of every slot, in order of first use
+    vector<HashCode> params;
+    size_t registers;
+
+    inline Program(): fuse(true), root(-1), registers(1) {
+        BuildTable();
+    }
+
+    // Slot of a parameter, -1 if the program never reads it
+    inline int Find(const HashCode &name) const {
+        uint32_t mask = (uint32_t)(table.size() - 1);
+        for (uint32_t b = Bucket(name); ; b = (b + 1) & mask) {
+            const Entry &entry = table[b];
+            if (entry.slot == Empty)
+                return -1;
+            if (entry.name == name)
+                return entry.slot;
+        }
+    }
+
+    inline static Bool Compare(const Slot &a, const CmpOp &op, const PropValInt &b) {
+        if (a.type == Expression::PropInt)
+            return Bool(Cmp(a.val_int, op, b));
+        if (a.type == Expression::PropFloat)
+            return Bool(Cmp(a.val_float, op, (PropValFloat)b));
+        return Bool(a.type == Expression::PropNone);
+    }
+    inline static Bool Compare(const Slot &a, const CmpOp &op, const PropValFloat &b) {
+        if (a.type == Expression::PropFloat)
+            return Bool(Cmp(a.val_float, op, b));
+        if (a.type == Expression::PropInt)
+            return Bool(Cmp((PropValFloat)a.val_int, op, b));
+        return Bool(a.type == Expression::PropNone);
+    }
+    inline static Bool Compare(const Slot &a, const CmpOp &op, const HashCode &b) {
+        if (a.type == Expression::PropString)
+            return Bool(Cmp(a.val_string, op, b));
+        return Bool(a.type == Expression::PropNone);
+    }
+    inline static Bool Compare(const Slot &a, const CmpOp &op, const Slot &b) {
+        if (b.type == Expression::PropInt)
+            return Compare(a, op, b.val_int);
+        if (b.type == Expression::PropFloat)
+            return Compare(a, op, b.val_float);
+        if (b.type == Expression::PropString)
+            return Compare(a, op, b.val_string);
+        return Bool(true);
+    }
+    // Bools compare True when either side is Undefined, False < True otherwise
+    inline static Bool Compare(const Bool &a, const CmpOp &op, const Bool &b) {
+        switch (op) {
+            case Expression::Eq:
+                return a == b;
+            case Expression::Ge:
+                return b <= a;
+            case Expression::Le:
+                return a <= b;
+            case Expression::Gt:
+                return b < a;
+            case Expression::Lt:
+                return a < b;
+            default:
+                assert(false);
+        }
+        return Bool(true);
+    }
+
+    template <typename T>
+    inline static Bool Between(const Slot &a, const uint16_t &open, const T &lo, const T &hi) {
+        return Compare(a, open & Instruction::LowOpen ? Expression::Gt : Expression::Ge, lo) &&
+               Compare(a, open & Instruction::HighOpen ? Expression::Lt : Expression::Le, hi);
+    }
+
+    // Lowers a postfix expression as produced by Expressions::Parse, after
+    // simplifying it. A rule folded to a constant reads no parameter at all.
+    // Without ranges, bounds are emitted as separate compares.
+    void Compile(const vector<Expression> &rpn, const bool &ranges = true) {
+        nodes.clear();
+        code.clear();
+        params.clear();
+        registers = 1;
+        fuse = ranges;
+
+        vector<int> stack;
+        for (const Expression &exp: rpn) {
+            if (exp.type == Expression::PropOp) {
+                assert(stack.size() >= 2);
+                int rhs = stack.back();
+                stack.pop_back();
+                int lhs = stack.back();
+                stack.pop_back();
+                nodes.emplace_back(exp, vector<int>{lhs, rhs});
+            } else {
+                nodes.emplace_back(exp);
+            }
+            stack.push_back((int)nodes.size() - 1);
+        }
+        assert(stack.size() <= 1);
+
+        // An '&' or '|' is chained when its parent is the same op
+        vector<bool> chained(nodes.size(), false);
+        for (const Node &node: nodes)
+            for (const int &kid: node.kids)
+                chained[kid] = node.IsLogic() && nodes[kid].IsLogic() && nodes[kid].exp.cmp_op == node.exp.cmp_op;
+        // Operands come before their operator in RPN order, so one pass
+        // simplifies bottom-up however deep the rule nests
+        vector<int> simple(nodes.size());
+        for (size_t i = 0; i < simple.size(); ++i)
+            simple[i] = Simplify((int)i, simple, chained);
+        root = stack.empty() ? -1 : simple[stack.back()];
+        history.assign(nodes.size(), Stat());
+        Emit();
+        BuildTable();
+    }
+
+    // Re-emits the program with its '&' and '|' operands ordered by the
+    // outcomes counted into stats, one per instruction, by Run. Slots stay
+    // the same, registers may change. Older counts weigh half at every call,
+    // so the order follows a shifting mix of rows. Drops any rewrite of code.
+    void Reorder(vector<Stat> &stats) {
+        assert(stats.size() == code.size());
+        for (Stat &seen: history) {
+            seen.evals >>= 1;
+            seen.trues >>= 1;
+            seen.falses >>= 1;
+        }
+        for (size_t i = 0; i < code.size(); ++i) {
+            if (origin[i] < 0)
+                continue;
+            Stat &seen = history[origin[i]];
+            seen.evals += stats[i].evals;
+            seen.trues += stats[i].trues;
+            seen.falses += stats[i].falses;
+        }
+        // Kids before parents, without recursing on deep rules
+        vector<int> order;
+        if (root >= 0)
+            order.push_back(root);
+        for (size_t i = 0; i < order.size(); ++i)
+            order.insert(order.end(), nodes[order[i]].kids.begin(), nodes[order[i]].kids.end());
+        vector<Estimate> ranked(nodes.size());
+        for (auto it = order.rbegin(); it != order.rend(); ++it)
+            ranked[*it] = Rank(*it, ranked);
+        Emit();
+        stats.assign(code.size(), Stat());
+    }
+
+    inline Bool Run(const Slot *slots, Bool *regs) const {
+        return Exec<false>(slots, regs, nullptr);
+    }
+    // Also counts the outcome of every instruction into stats, see Reorder
+    inline Bool Run(const Slot *slots, Bool *regs, Stat *stats) const {
+        return Exec<true>(slots, regs, stats);
+    }
+
+    // Kids of an '&' or '|' counted by the results they may still come to,
+    // from which follow the results of the node, see Outcome
+    struct Tally {
+        // May be the result that decides the node, False for '&'
+        uint32_t decide;
+        // May be the other definite result
+        uint32_t pass;
+        // Can be neither Undefined nor the other result, so decides
+        uint32_t stuck;
+        // Cannot be Undefined
+        uint32_t defined;
+
+        inline Tally(): decide(0), pass(0), stuck(0), defined(0) {}
+    };
+
+    // Row state of Possible: the results every node of the rule may still
+    // come to, as a mask of 1 << ReturnType, and the tallies of '&' and '|'
+    struct Outcomes {
+        vector<uint8_t> masks;
+        vector<Tally> tallies;
+    };
+
+    // Results a row still being bound may come to, as a mask of
+    // 1 << ReturnType: slots left clear may yet get any value or stay
+    // missing, so their compares may be True or False. Operands count as
+    // independent, so the mask may hold more than can happen but never less.
+    //
+    // This one works every node out from the slots bound so far, kids
+    // first; the one taking a slot follows up a binding of it, and only
+    // updates the compares reading the slot and the nodes above them while
+    // their masks change.
+    uint8_t Possible(const Slot *slots, Outcomes &out) const {
+        out.masks.assign(nodes.size(), 0);
+        out.tallies.assign(nodes.size(), Tally());
+        for (auto it = tree.rbegin(); it != tree.rend(); ++it) {
+            const Node &node = nodes[*it];
+            uint8_t &mask = out.masks[*it];
+            if (!Inner(node)) {
+                mask = Leaf(slots, code[leaf_pc[*it]]);
+            } else if (node.IsLogic()) {
+                bool is_and = node.exp.cmp_op == Expression::And;
+                Tally &tally = out.tallies[*it];
+                for (const int &kid: node.kids)
+                    Count(tally, out.masks[kid], is_and, 1);
+                mask = Outcome(tally, is_and);
+            } else {
+                CmpOp op = node.exp.cmp_op;
+                mask = Combine(out.masks[node.kids[0]], out.masks[node.kids[1]],
+                               [&](const Bool &a, const Bool &b) { return Compare(a, op, b); });
+            }
+        }
+        return root < 0 ? 1 << Expression::Undefined : out.masks[root];
+    }
+    // Outcomes of a row with no slot bound yet, to follow up from
+    inline void Start(Outcomes &out) const {
+        out.masks = blank.masks;
+        out.tallies = blank.tallies;
+    }
+    uint8_t Possible(const Slot *slots, const uint16_t &slot, Outcomes &out) const {
+        for (uint32_t i = reader_begin[slot]; i < reader_begin[slot + 1]; ++i)
+            Raise(readers[i], Leaf(slots, code[leaf_pc[readers[i]]]), out);
+        return root < 0 ? 1 << Expression::Undefined : out.masks[root];
+    }
+
+private:
+    // Of the tree as last emitted, for Possible: its nodes, parents before
+    // kids; the parent of every node, -1 for the root; the instruction of
+    // every leaf; and the leaves reading each slot s, at
+    // readers[reader_begin[s]] up to reader_begin[s + 1]
+    vector<int> tree;
+    vector<int> up;
+    vector<uint32_t> leaf_pc;
+    vector<uint32_t> reader_begin;
+    vector<int> readers;
+    // Possible with no slot bound
+    Outcomes blank;
+
+    // '&', '|' and compares of Bools, whose kids are nodes of their own
+    inline bool Inner(const Node &node) const {
+        if (!node.IsOp() || node.range)
+            return false;
+        return node.IsLogic() || !nodes[node.kids[0]].IsValue() || !nodes[node.kids[1]].IsValue();
+    }
+
+    inline static uint8_t Leaf(const Slot *slots, const Instruction &ins) {
+        const uint8_t either = 1 << Expression::False | 1 << Expression::True;
+        if (ins.code == Instruction::Load)
+            return 1 << ins.val_bool;
+        if (slots[ins.a].type == Expression::PropNone)
+            return either;
+        if (ins.code >= Instruction::CmpParam && ins.code < Instruction::CmpBool)
+            return slots[ins.b].type == Expression::PropNone ? either : 1 << Compare(slots[ins.a], ins.Op(), slots[ins.b]).ans;
+        return 1 << Compare(slots[ins.a], ins).ans;
+    }
+
+    // Adds a kid's mask to the tally of its '&' or '|', or takes it off
+    inline static void Count(Tally &tally, const uint8_t &mask, const bool &is_and, const uint32_t &n) {
+        int decide = is_and ? Expression::False : Expression::True;
+        int pass = is_and ? Expression::True : Expression::False;
+        tally.decide += (mask >> decide & 1) * n;
+        tally.pass += (mask >> pass & 1) * n;
+        tally.stuck += (mask & (1 << Expression::Undefined | 1 << pass)) == 0 ? n : 0;
+        tally.defined += (mask >> Expression::Undefined & 1) == 0 ? n : 0;
+    }
+
+    // One kid deciding gives its result; else all kids Undefined or the
+    // other result, and one of them that, gives that; all Undefined, Undefined
+    inline static uint8_t Outcome(const Tally &tally, const bool &is_and) {
+        int decide = is_and ? Expression::False : Expression::True;
+        int pass = is_and ? Expression::True : Expression::False;
+        return (tally.decide > 0 ? 1 << decide : 0) | (tally.stuck == 0 && tally.pass > 0 ? 1 << pass : 0) |
+               (tally.defined == 0 ? 1 << Expression::Undefined : 0);
+    }
+
+    // Sets the mask of a node and carries the change up the tree
+    void Raise(int idx, uint8_t mask, Outcomes &out) const {
+        while (out.masks[idx] != mask) {
+            uint8_t old = out.masks[idx];
+            out.masks[idx] = mask;
+            int parent = up[idx];
+            if (parent < 0)
+                return;
+            const Node &node = nodes[parent];
+            if (node.IsLogic()) {
+                bool is_and = node.exp.cmp_op == Expression::And;
+                Tally &tally = out.tallies[parent];
+                Count(tally, old, is_and, (uint32_t)-1);
+                Count(tally, mask, is_and, 1);
+                mask = Outcome(tally, is_and);
+            } else {
+                CmpOp op = node.exp.cmp_op;
+                mask = Combine(out.masks[node.kids[0]], out.masks[node.kids[1]],
+                               [&](const Bool &a, const Bool &b) { return Compare(a, op, b); });
+            }
+            idx = parent;
+        }
+    }
+
+    // Builds the tables of Possible for the program just emitted
+    void Outline() {
+        up.assign(nodes.size(), -1);
+        leaf_pc.assign(nodes.size(), 0);
+        for (uint32_t pc = 0; pc < code.size(); ++pc)
+            if (origin[pc] >= 0)
+                leaf_pc[origin[pc]] = pc;
+        reader_begin.assign(params.size() + 1, 0);
+        readers.clear();
+
+        // Parents before kids, without recursing on deep rules
+        tree.clear();
+        vector<std::pair<uint16_t, int>> reads;
+        if (root >= 0)
+            tree.push_back(root);
+        for (size_t i = 0; i < tree.size(); ++i) {
+            int idx = tree[i];
+            if (Inner(nodes[idx])) {
+                for (const int &kid: nodes[idx].kids) {
+                    assert(up[kid] < 0);
+                    up[kid] = idx;
+                    tree.push_back(kid);
+                }
+                continue;
+            }
+            const Instruction &ins = code[leaf_pc[idx]];
+            if (ins.code == Instruction::Load)
+                continue;
+            reads.emplace_back(ins.a, idx);
+            if (ins.code >= Instruction::CmpParam && ins.code < Instruction::CmpBool && ins.b != ins.a)
+                reads.emplace_back(ins.b, idx);
+        }
+
+        for (const auto &read: reads)
+            ++reader_begin[read.first + 1];
+        for (size_t slot = 0; slot < params.size(); ++slot)
+            reader_begin[slot + 1] += reader_begin[slot];
+        readers.resize(reads.size());
+        vector<uint32_t> at(reader_begin.begin(), reader_begin.end() - 1);
+        for (const auto &read: reads)
+            readers[at[read.first]++] = read.second;
+
+        vector<Slot> none(params.size());
+        Possible(none.data(), blank);
+    }
+
+    template <typename Op>
+    inline static uint8_t Combine(const uint8_t &a, const uint8_t &b, const Op &op) {
+        uint8_t mask = 0;
+        for (int x = Expression::Undefined; x <= Expression::True; ++x)
+            for (int y = Expression::Undefined; y <= Expression::True; ++y)
+                if ((a >> x & 1) && (b >> y & 1))
+                    mask |= 1 << op(Bool((Expression::ReturnType)x), Bool((Expression::ReturnType)y)).ans;
+        return mask;
+    }
+
+    // A compare or range of one slot with the constants of ins
+    inline static Bool Compare(const Slot &a, const Instruction &ins) {
+        if (ins.code == Instruction::RangeInt)
+            return Between(a, ins.b, ins.val_int, ins.hi_int);
+        if (ins.code == Instruction::RangeFloat)
+            return Between(a, ins.b, ins.val_float, ins.hi_float);
+        if (ins.code < Instruction::CmpFloat)
+            return Compare(a, ins.Op(), ins.val_int);
+        if (ins.code < Instruction::CmpString)
+            return Compare(a, ins.Op(), ins.val_float);
+        return Compare(a, ins.Op(), ins.val_string);
+    }
+
+    template <bool profile>
+    inline Bool Exec(const Slot *slots, Bool *regs, Stat *stats) const {
+        const Instruction *begin = code.data();
+        const Instruction *end = begin + code.size();
+        for (const Instruction *pc = begin; pc != end; ++pc) {
+            const Instruction &ins = *pc;
+            Bool &r = regs[ins.dst];
+            Stat *stat = profile ? stats + (pc - begin) : nullptr;
+            switch (ins.code) {
+                case Instruction::CmpInt + Expression::Eq:
+                    r = Compare(slots[ins.a], Expression::Eq, ins.val_int);
+                    break;
+                case Instruction::CmpInt + Expression::Ge:
+                    r = Compare(slots[ins.a], Expression::Ge, ins.val_int);
+                    break;
+                case Instruction::CmpInt + Expression::Le:
+                    r = Compare(slots[ins.a], Expression::Le, ins.val_int);
+                    break;
+                case Instruction::CmpInt + Expression::Gt:
+                    r = Compare(slots[ins.a], Expression::Gt, ins.val_int);
+                    break;
+                case Instruction::CmpInt + Expression::Lt:
+                    r = Compare(slots[ins.a], Expression::Lt, ins.val_int);
+                    break;
+                case Instruction::CmpFloat + Expression::Eq:
+                    r = Compare(slots[ins.a], Expression::Eq, ins.val_float);
+                    break;
+                case Instruction::CmpFloat + Expression::Ge:
+                    r = Compare(slots[ins.a], Expression::Ge, ins.val_float);
+                    break;
+                case Instruction::CmpFloat + Expression::Le:
+                    r = Compare(slots[ins.a], Expression::Le, ins.val_float);
+                    break;
+                case Instruction::CmpFloat + Expression::Gt:
+                    r = Compare(slots[ins.a], Expression::Gt, ins.val_float);
+                    break;
+                case Instruction::CmpFloat + Expression::Lt:
+                    r = Compare(slots[ins.a], Expression::Lt, ins.val_float);
+                    break;
+                case Instruction::CmpString + Expression::Eq:
+                    r = Compare(slots[ins.a], Expression::Eq, ins.val_string);
+                    break;
+                case Instruction::CmpString + Expression::Ge:
+                    r = Compare(slots[ins.a], Expression::Ge, ins.val_string);
+                    break;
+                case Instruction::CmpString + Expression::Le:
+                    r = Compare(slots[ins.a], Expression::Le, ins.val_string);
+                    break;
+                case Instruction::CmpString + Expression::Gt:
+                    r = Compare(slots[ins.a], Expression::Gt, ins.val_string);
+                    break;
+                case Instruction::CmpString + Expression::Lt:
+                    r = Compare(slots[ins.a], Expression::Lt, ins.val_string);
+                    break;
+                case Instruction::Load:
+                    r = Bool(ins.val_bool);
+                    break;
+                case Instruction::And:
+                    r = r && regs[ins.a];
+                    break;
+                case Instruction::Or:
+                    r = r || regs[ins.a];
+                    break;
+                case Instruction::JumpFalse:
+                    if (r.ans == Expression::False)
+                        pc = begin + ins.target - 1;
+                    break;
+                case Instruction::JumpTrue:
+                    if (r.ans == Expression::True)
+                        pc = begin + ins.target - 1;
+                    break;
+                case Instruction::RangeInt:
+                    r = Between(slots[ins.a], ins.b, ins.val_int, ins.hi_int);
+                    break;
+                case Instruction::RangeFloat:
+                    r = Between(slots[ins.a], ins.b, ins.val_float, ins.hi_float);
+                    break;
+                default:
+                    if (ins.code < Instruction::CmpBool)
+                        r = Compare(slots[ins.a], ins.Op(), slots[ins.b]);
+                    else
+                        r = Compare(regs[ins.a], ins.Op(), regs[ins.b]);
+            }
+            // And, Or and jumps only glue the compares, see Reorder
+            if (profile && (ins.code < Instruction::And || ins.code > Instruction::JumpTrue)) {
+                ++stat->evals;
+                stat->trues += r.ans == Expression::True;
+                stat->falses += r.ans == Expression::False;
+            }
+        }
+        return regs[0];
+    }
+
+public:
+    inline friend ostream & operator << (ostream &w, const Program &prog) {
+        for (const Instruction &ins: prog.code)
+            w << ins << std::endl;
+        return w;
+    }
+};
+
+// Tells cheaply whether a property name may be one of the parameters an
+// expression reads, from its length and first and last bytes, so most other
+// names are dropped before they are hashed. False positives are fine.
+struct Prefilter {
+    uint64_t lengths;
+    uint64_t heads[4];
+    uint64_t tails[4];
+
+    // Passes every name until the first Clear
+    inline Prefilter() {
+        lengths = ~0ULL;
+        std::fill(heads, heads + 4, ~0ULL);
+        std::fill(tails, tails + 4, ~0ULL);
+    }
+
+    inline void Clear() {
+        lengths = 0;
+        std::fill(heads, heads + 4, 0ULL);
+        std::fill(tails, tails + 4, 0ULL);
+    }
+
+    inline void Add(const char *name, const size_t &len) {
+        lengths |= 1ULL << std::min(len, (size_t)63);
+        if (len == 0)
+            return;
+        unsigned char head = name[0], tail = name[len - 1];
+        heads[head >> 6] |= 1ULL << (head & 63);
+        tails[tail >> 6] |= 1ULL << (tail & 63);
+    }
+
+    inline bool Pass(const char *name, const size_t &len) const {
+        if (!(lengths >> std::min(len, (size_t)63) & 1))
+            return false;
+        if (len == 0)
+            return true;
+        unsigned char head = name[0], tail = name[len - 1];
+        return (heads[head >> 6] >> (head & 63) & 1) && (tails[tail >> 6] >> (tail & 63) & 1);
+    }
+};
+
+// Codes of the string literals of an expression, so that comparing codes is
+// comparing bytes. Every distinct literal gets its own code, its Hash unless
+// another literal took it; a row value gets the code of the literal with the
+// same bytes, or else a code no literal has. Bytes are only compared when a
+// value hashes to a code the literals use, which the filter mostly rules out.
+// Two row values are still told apart by Hash alone, so one parameter equal
+// to another can be a collision, and values of one Hash order by code.
+class Strings {
+    // Literals by the Hash of their bytes
+    std::unordered_map<HashCode, vector<HashCode>> literals;
+    // Bytes of every code given out
+    std::unordered_map<HashCode, std::string> codes;
+    // A bit per top 10 bits of the hashes and codes of the literals
+    uint64_t filter[16];
+
+    inline void Mark(const HashCode &code) {
+        filter[code >> 28] |= 1ULL << (code >> 22 & 63);
+    }
+    inline bool Marked(const HashCode &code) const {
+        return filter[code >> 28] >> (code >> 22 & 63) & 1;
+    }
+
+    // The first code from hash on that no literal has
+    inline HashCode Spare(HashCode code) const {
+        while (codes.count(code) != 0)
+            ++code;
+        return code;
+    }
+
+public:
+    inline Strings() {
+        Clear();
+    }
+
+    inline void Clear() {
+        literals.clear();
+        codes.clear();
+        std::fill(filter, filter + 16, 0ULL);
+    }
+
+    inline size_t Size() const {
+        return codes.size();
+    }
+
+    // Code of a literal, given on first sight
+    inline HashCode Intern(const char *str, const size_t &len) {
+        HashCode hash = Hash(str, len);
+        vector<HashCode> &same = literals[hash];
+        for (const HashCode &code: same) {
+            const std::string &bytes = codes[code];
+            if (bytes.size() == len && memcmp(bytes.data(), str, len) == 0)
+                return code;
+        }
+        HashCode code = Spare(hash);
+        same.push_back(code);
+        codes.emplace(code, std::string(str, len));
+        Mark(hash);
+        Mark(code);
+        return code;
+    }
+
+    // Code of a row value
+    inline HashCode Code(const char *str, const size_t &len) const {
+        HashCode hash = Hash(str, len);
+        if (!Marked(hash))
+            return hash;
+        auto it = literals.find(hash);
+        if (it != literals.end()) {
+            for (const HashCode &code: it->second) {
+                const std::string &bytes = codes.find(code)->second;
+                if (bytes.size() == len && memcmp(bytes.data(), str, len) == 0)
+                    return code;
+            }
+        }
+        return Spare(hash);
+    }
+
+    // Bytes of a literal code, nullptr for other codes
+    inline const std::string * Bytes(const HashCode &code) const {
+        auto it = codes.find(code);
+        return it == codes.end() ? nullptr : &it->second;
+    }
+};
+
 class Expressions: public vector<Expression> {
 
     using Self = vector<Expression>;
@@ -210,26 +1613,28 @@ class Expressions: public vector<Expression> {
     using PropValInt = Expression::PropValInt;
     using PropValFloat = Expression::PropValFloat;
 
+    // Operator stack of Parse, in a buffer Reserve sizes once per input so
+    // Push never checks for room
     template<typename T>
     class Stack {
-        size_t capacity;
-        T *tail;
-        T *content;
+        vector<T> content;
+        size_t size;
 
     public:
-        inline explicit Stack(size_t capacity_ = 32) : capacity(capacity_) {
-            content = new T[capacity];
-            tail = content;
-        }
-        inline ~Stack() {
-            delete[] content;
+        inline Stack() : size(0) {}
+
+        // Empties the stack and makes room for depth entries
+        inline void Reserve(const size_t &depth) {
+            if (content.size() < depth)
+                content.resize(depth);
+            size = 0;
         }
 
         inline size_t Size() {
-            return tail - content;
+            return size;
         }
         inline bool Empty() {
-            return tail == content;
+            return size == 0;
         }
 
         inline const T Top() {
@@ -237,60 +1642,27 @@ class Expressions: public vector<Expression> {
                 assert(false);
                 return T();
             }
-            return *(tail - 1);
+            return content[size - 1];
         }
         inline const T Pop() {
             if (Empty()) {
                 assert(false);
                 return T();
             }
-            return *(--tail);
+            return content[--size];
         }
         inline void Push(const T &x) {
-            if (Size() == capacity) {
-                auto *tmp = new T[capacity << 1];
-                memcpy(content, tmp, sizeof(T) * capacity);
-                delete[] content;
-                content = tmp;
-                tail = content + capacity;
-                capacity <<= 1;
-            }
-            *tail = x;
-            ++tail;
+            assert(size < content.size());
+            content[size++] = x;
         }
 
         inline friend ostream & operator << (ostream &w, Stack &x) {
-            if (!x.Empty()) {
-                for (auto p = x.tail - 1; ; --p) {
-                    w << *p << " ";
-                    if (p == x.content) {
-                        break;
-                    }
-                }
-            }
+            for (size_t i = x.size; i > 0; --i)
+                w << x.content[i - 1] << " ";
             return w;
         }
     };
 
-    class Pair {
-    public:
-        HashCode name;
-        Expression exp;
-        inline Pair(): name(0), exp() {}
-        inline Pair(const HashCode &name_, const Expression &exp_): name(name_), exp(exp_) {}
-
-        inline void set(const HashCode &name_, const Expression &exp_) {
-            name = name_;
-            exp = exp_;
-        }
-        inline bool operator < (const Pair& rhs) const {
-            return name < rhs.name;
-        }
-        inline bool operator == (const Pair& rhs) const {
-            return name == rhs.name;
-        }
-    };
-
     inline bool IsW(const char &c) {
         return isalpha(c) || isdigit(c) || c == '_';
     }
@@ -308,23 +1680,53 @@ class Expressions: public vector<Expression> {
         return 1;
     }
 
-    inline Expression get(Pair *src_begin, Pair *src_end, const HashCode &hashcode) {
-        Expression exp;
-        Pair p(hashcode, exp.AssignBool());
-//        Pair *ret = std::find(src_begin, src_end, p);
-        Pair *ret = std::lower_bound(src_begin, src_end, p);
+    Stack<Expression> stack;
+    Prefilter prefilter;
+    Strings strings;
+    // Parameter names as written, by their Hash
+    std::unordered_map<HashCode, std::string> names;
 
-        if (ret != src_end && ret->name == hashcode) {
-            return ret->exp;
-        } else {
-            return exp;
-        }
-    }
+    Program program;
 
-    Stack<Expression> stack;
-    Pair used[16];
+public:
+    // Row state of one evaluation. Only Parse, Compile and Adapt change an
+    // Expressions, so threads can share a parsed one read-only, each
+    // matching with a Context of its own.
+    struct Context {
+        vector<Slot> slots;
+        vector<Expression::Bool> regs;
+        Program::Outcomes outcomes;
+        // Where Eval counts outcomes, see PredicateCounters; nullptr for none
+        Program::Stat *stats = nullptr;
+        // Stats at stats, the most Count writes
+        size_t stat_count = 0;
+    };
+
+private:
+    // Context of Match and Eval without one
+    Context context;
+
+    // Adaptive ordering, see Adapt
+    uint32_t period;
+    uint32_t rows;
+    vector<Program::Stat> stats;
+
+    // Eval counting into ctx.stats: the row in the first Stat, then every
+    // instruction in the order of the program. A program grown past them
+    // since, as a reordering may, is evaluated but not counted.
+    bool Count(Context &ctx) const {
+        if (1 + program.code.size() > ctx.stat_count)
+            return program.Run(ctx.slots.data(), ctx.regs.data()).ans != Expression::False;
+        Expression::ReturnType ans = program.Run(ctx.slots.data(), ctx.regs.data(), ctx.stats + 1).ans;
+        Program::Stat &row = ctx.stats[0];
+        ++row.evals;
+        row.trues += ans == Expression::True;
+        row.falses += ans == Expression::False;
+        return ans != Expression::False;
+    }
 
 public:
+    inline Expressions(): period(0), rows(0) {}
 
     inline friend ostream & operator << (ostream &w, const Expressions &exps) {
         for (const Expression &exp: exps) {
@@ -333,11 +1735,112 @@ public:
         return w;
     }
 
+    inline const Program & Compiled() const {
+        return program;
+    }
+
+    // Row binding for front ends that produce properties themselves, e.g.
+    // SaxMatcher: Reset, Bind the referenced parameters, then Eval.
+    inline void Reset(Context &ctx) const {
+        ctx.slots.resize(program.params.size());
+        for (Slot &slot: ctx.slots)
+            slot.Clear();
+        ctx.outcomes.masks.clear();
+        if (ctx.regs.size() < program.registers)
+            ctx.regs.resize(program.registers, Expression::Bool(Expression::Undefined));
+    }
+    inline void Reset() {
+        Reset(context);
+    }
+    // Slot of a referenced parameter name, -1 if the expression never reads it
+    inline int Find(const char *name, size_t len) const {
+        if (!prefilter.Pass(name, len))
+            return -1;
+        return program.Find(Hash(name, len));
+    }
+    // Code of a string value as the program compares it, see Strings
+    inline HashCode Code(const char *str, const size_t &len) const {
+        return strings.Code(str, len);
+    }
+    inline const Strings & Literals() const {
+        return strings;
+    }
+    inline const Slot * Slots() const {
+        return context.slots.data();
+    }
+    inline Slot & Bind(const int &slot) {
+        return context.slots[slot];
+    }
+    inline size_t Params() const {
+        return program.params.size();
+    }
+    // Name of the parameter in a slot, '$slot' for one not parsed from text
+    inline std::string Name(const int &slot) const {
+        auto it = names.find(program.params[slot]);
+        return it == names.end() ? "$" + std::to_string(slot) : it->second;
+    }
+    // For rows bound a parameter at a time: whether the row is decided
+    // whatever the parameters not bound yet turn out to be, missing ones
+    // included, and if so whether it matches. A front end can stop reading
+    // the row then. Called after each binding, with the slot just bound, it
+    // re-checks only what reads that slot.
+    inline bool Decided(Context &ctx, const int &slot, bool &matched) const {
+        if (ctx.outcomes.masks.empty())
+            program.Start(ctx.outcomes);
+        uint8_t possible = program.Possible(ctx.slots.data(), (uint16_t)slot, ctx.outcomes);
+        if (possible & 1 << Expression::False) {
+            matched = false;
+            return possible == 1 << Expression::False;
+        }
+        matched = true;
+        return true;
+    }
+    inline bool Eval(Context &ctx) const {
+        if (ctx.stats != nullptr)
+            return Count(ctx);
+        return program.Run(ctx.slots.data(), ctx.regs.data()).ans != Expression::False;
+    }
+    inline bool Eval() {
+        if (period == 0)
+            return Eval(context);
+        bool matched = program.Run(context.slots.data(), context.regs.data(), stats.data()).ans != Expression::False;
+        if (++rows == period) {
+            rows = 0;
+            program.Reorder(stats);
+            context.regs.resize(program.registers, Expression::Bool(Expression::Undefined));
+        }
+        return matched;
+    }
+
+    // Counts the outcome of every comparison and, every period rows, orders
+    // the operands of '&' and '|' so the cheapest ones likely to decide run
+    // first. 0 keeps the order as written. Results do not change. Only Match
+    // and Eval without a Context count, and the reordering rewrites the
+    // program other threads may be running.
+    inline void Adapt(const uint32_t &period_) {
+        period = period_;
+        rows = 0;
+        stats.assign(program.code.size(), Program::Stat());
+    }
+
+    // Lowers the parsed RPN into the program Match runs; Parse calls it
+    void Compile() {
+        program.Compile(*this);
+        Reset(context);
+        rows = 0;
+        stats.assign(program.code.size(), Program::Stat());
+    }
+
     void Parse(const char *in) {
         Self::clear();
+        prefilter.Clear();
+        strings.Clear();
+        names.clear();
         Expression ret;
         char g = 0;
         auto len = (int)strlen(in);
+        // Every '(' and operator pushed takes at least one character
+        stack.Reserve(len);
         for (int i = 0; i < len; ) {
             g = in[i];
             if (isblank(g)) {
@@ -346,10 +1849,14 @@ public:
             }
 
             if (isalpha(g)) {
-                HashCode hashcode = 0;
-                while (IsW(in[i]))
-                    hashcode = hashcode * 131U + in[i ++];
-                Self::emplace_back(ret.AssignParameter(hashcode));
+                int j = i;
+                while (IsW(in[j]))
+                    ++j;
+                HashCode name = Hash(in + i, j - i);
+                names.emplace(name, std::string(in + i, j - i));
+                Self::emplace_back(ret.AssignParameter(name));
+                prefilter.Add(in + i, j - i);
+                i = j;
             } else if (isdigit(g) || g == '-') {
                 PropValInt ans = 0, fac = 1;
                 PropValFloat ansFloat = 0;
@@ -379,12 +1886,11 @@ public:
                     assert(false);
             } else if (g == '\'') {
                 // TODO: solve complex case
-                ++i;
-                int j = 0;
-                HashCode hashcode = 0;
-                while ((g = in[i++]) != '\'')
-                    hashcode = hashcode * 131U + g;
-                Self::emplace_back(ret.Assign(hashcode));
+                int j = ++i;
+                while (in[j] != '\'')
+                    ++j;
+                Self::emplace_back(ret.Assign(strings.Intern(in + i, j - i)));
+                i = j + 1;
             } else if (g == '(') {
                 ++i;
                 stack.Push(ret.AssignLeftBracket());
@@ -415,52 +1921,51 @@ public:
 
         while (!stack.Empty())
             Self::emplace_back(stack.Pop());
+        Compile();
     }
 
+    // Rows may be of any width: properties the expression does not read are
+    // skipped after one probe without being stored, and the scan stops as
+    // soon as every referenced parameter is bound.
     template <typename iterable>
     inline bool Match(const iterable& props) {
-        Expression exp;
-        int cnt = 0, tot = props.size();
-        for (auto it = props.begin(); cnt < tot; ++it, ++cnt) {
-            auto type = it->Type();
-            HashCode hashcode = 0;
-            const char *p = it->Name();
-            int len = it->NameLen();
-            for (int i = 0; i < len; ++i) {
-                hashcode = hashcode * 131U + p[i];
-            }
-            if (type == Expression::PropString) {
-                HashCode hashcode2 = 0;
-                const char *q = it->String();
-                len = it->ValLen();
-                for (int i = 0; i < len; ++i) {
-                    hashcode2 = hashcode2 * 131U + q[i];
-                }
-                used[cnt].set(hashcode, exp.Assign(hashcode2));
-            } else if (type == Expression::PropInt) {
-                used[cnt].set(hashcode, exp.Assign(it->Int()));
-            } else if (type == Expression::PropFloat) {
-                used[cnt].set(hashcode, exp.Assign(it->Float()));
-            } else {
-                assert(false);
-            }
-        }
-        std::sort(used, used + cnt);
+        Load(props, context);
+        return Eval();
+    }
+    // Thread-safe Match, see Context
+    template <typename iterable>
+    inline bool Match(const iterable& props, Context &ctx) const {
+        Load(props, ctx);
+        return Eval(ctx);
+    }
 
-        Expression t1, t2;
-        for (const Expression &e: *this) {
-            if (e.type == Expression::PropParameter) {
-                stack.Push(get(used, used + cnt, e.name));
-            } else if (e.type != Expression::PropOp) {
-                stack.Push(e);
-            } else {
-                t1 = stack.Pop();
-                t2 = stack.Pop();
-                stack.Push(t2.Calc(e.cmp_op, t1));
-            }
+    // Binds a row without evaluating it, for Eval or another evaluator of
+    // slots such as Jit
+    template <typename iterable>
+    inline void Load(const iterable& props) {
+        Load(props, context);
+    }
+    template <typename iterable>
+    inline void Load(const iterable& props, Context &ctx) const {
+        Reset(ctx);
+        vector<Slot> &slots = ctx.slots;
+        // Rules folded to a constant read no parameter and skip the row
+        size_t pending = slots.size();
+        size_t tot = props.size();
+        for (auto it = props.begin(); tot > 0 && pending > 0; ++it, --tot) {
+            int slot = Find(it->Name(), it->NameLen());
+            if (slot < 0 || slots[slot].type != Expression::PropNone)
+                continue;
+            auto type = it->Type();
+            if (type == Expression::PropString)
+                slots[slot].Assign(strings.Code(it->String(), it->ValLen()));
+            else if (type == Expression::PropInt)
+                slots[slot].Assign(it->Int());
+            else if (type == Expression::PropFloat)
+                slots[slot].Assign(it->Float());
+            else
+                continue;   // bool, null and nested values are not comparable
+            --pending;
         }
-
-        // assert(stack.Size() == 1);
-        return stack.Pop().val_bool.ans != Expression::False;
     }
 };
@@ -0,0 +1,27 @@
+#include "gen.h"
+
+// Writes synthetic rows or rules, one per line, see Generator.
+//
+// Usage: ./gen rows|rules [--seed n] [--count n] [--attrs n] [--strings f]
+//              [--card n] [--zipf s] [--strlen n] [--presence f]
+//              [--preds n] [--op and|or|mixed] [--sel f[:g]]
+int main(int argc, char **argv) {
+    Config config;
+    if (!config.Parse(argc, argv)) {
+        fprintf(stderr, "usage: %s rows|rules [--seed n] [--count n] [--attrs n] [--strings f] [--card n]"
+                        " [--zipf s] [--strlen n] [--presence f] [--preds n] [--op and|or|mixed] [--sel f[:g]]\n",
+                argv[0]);
+        return 2;
+    }
+    Generator gen(config);
+    std::string line;
+    for (size_t i = 0; i < config.count; ++i) {
+        if (config.mode == "rows")
+            gen.Row(line);
+        else
+            gen.Rule(line);
+        line.push_back('\n');
+        fwrite(line.data(), 1, line.size(), stdout);
+    }
+    return 0;
+}
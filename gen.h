@@ -0,0 +1,222 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+using std::vector;
+
+// Synthetic workloads for benchmarks: NDJSON rows and rule files in the
+// grammar Expressions::Parse reads, over one schema of attributes a0, a1...
+// Attribute values are Zipfian: value rank r (0 the most common) comes with
+// odds proportional to 1 / (r + 1)^zipf. String attributes hold 'v<rank>'
+// padded to --strlen, numeric ones hold the rank itself.
+//
+// Each predicate of a rule is solved for a selectivity drawn log-uniformly
+// from the --sel range: 'a = value' picks the value whose odds come
+// closest, 'a < c' and 'a >= c' the cut of the ranks that does. That is
+// over rows carrying the attribute; the others match, as a comparison on a
+// missing parameter is True. Rules join their predicates with '&', '|', or
+// for 'mixed' as an '|' of '&' clauses.
+//
+// Output depends on the flags and seed only, not on the machine: draws come
+// straight from std::mt19937, never from the implementation-defined
+// distributions of <random>. Rows and rules made with the same schema flags
+// agree on it.
+//
+// See gen.cpp for the command line.
+struct Config {
+    std::string mode;
+    uint32_t seed = 1;
+    size_t count = 1000000;
+    int attrs = 20;
+    double strings = 0.5;
+    int card = 1000;
+    double zipf = 1.0;
+    int string_len = 8;
+    double presence = 0.9;
+    int preds = 4;
+    std::string op = "and";
+    double sel_lo = 0.05;
+    double sel_hi = 0.05;
+
+    bool Parse(int argc, char **argv) {
+        if (argc < 2)
+            return false;
+        mode = argv[1];
+        for (int i = 2; i + 1 < argc; i += 2) {
+            std::string key = argv[i], val = argv[i + 1];
+            if (key == "--seed") {
+                seed = (uint32_t)std::stoul(val);
+            } else if (key == "--count") {
+                count = std::stoul(val);
+            } else if (key == "--attrs") {
+                attrs = std::stoi(val);
+            } else if (key == "--strings") {
+                strings = std::stod(val);
+            } else if (key == "--card") {
+                card = std::stoi(val);
+            } else if (key == "--zipf") {
+                zipf = std::stod(val);
+            } else if (key == "--strlen") {
+                string_len = std::stoi(val);
+            } else if (key == "--presence") {
+                presence = std::stod(val);
+            } else if (key == "--preds") {
+                preds = std::stoi(val);
+            } else if (key == "--op") {
+                op = val;
+            } else if (key == "--sel") {
+                size_t colon = val.find(':');
+                sel_lo = std::stod(val.substr(0, colon));
+                sel_hi = colon == std::string::npos ? sel_lo : std::stod(val.substr(colon + 1));
+            } else {
+                return false;
+            }
+        }
+        return argc % 2 == 0 && (mode == "rows" || mode == "rules") && attrs > 0 && card > 0 && preds > 0 &&
+               (op == "and" || op == "or" || op == "mixed") && sel_lo > 0 && sel_lo <= sel_hi && sel_hi <= 1;
+    }
+};
+
+class Generator {
+    const Config &config;
+    std::mt19937 rng;
+    // Whether attribute i holds strings
+    vector<bool> is_string;
+    // Cumulative odds of the value ranks
+    vector<double> cdf;
+    // Row text of each rank, for string and numeric attributes
+    vector<std::string> strs;
+    vector<std::string> nums;
+
+    // Uniform in [0, 1)
+    inline double Uniform() {
+        uint64_t bits = (uint64_t)rng() << 32 | rng();
+        return (double)(bits >> 11) * (1.0 / 9007199254740992.0);
+    }
+    inline uint32_t Below(const uint32_t &n) {
+        return (uint32_t)(Uniform() * n);
+    }
+    inline int Rank() {
+        return (int)(std::upper_bound(cdf.begin(), cdf.end() - 1, Uniform()) - cdf.begin());
+    }
+    inline double Odds(const int &rank) const {
+        return cdf[rank] - (rank == 0 ? 0 : cdf[rank - 1]);
+    }
+
+    inline std::string Value(const int &rank) const {
+        std::string s = "v" + std::to_string(rank);
+        for (uint32_t h = (uint32_t)rank * 2654435761U; (int)s.size() < config.string_len; h = h * 1103515245U + 12345U)
+            s.push_back((char)('a' + (h >> 16) % 26));
+        return s;
+    }
+
+    // Odds of a rank below c
+    inline double Head(const int &c) const {
+        return c == 0 ? 0 : cdf[c - 1];
+    }
+    // Fewest ranks c with Head(c) closest to odds
+    inline int Cut(const double &odds) const {
+        int c = std::min(config.card, (int)(std::lower_bound(cdf.begin(), cdf.end(), odds) - cdf.begin()) + 1);
+        if (c > 0 && std::fabs(Head(c - 1) - odds) <= std::fabs(Head(c) - odds))
+            --c;
+        return c;
+    }
+
+    // A predicate on attribute attr true for about sel of its rows
+    std::string Predicate(const int &attr, const double &sel) {
+        std::string name = "a" + std::to_string(attr);
+        if (is_string[attr]) {
+            // Odds fall with the rank; of the values about as common as the
+            // closest one any will do
+            int r = 0, end = config.card;
+            while (r < end) {
+                int mid = (r + end) / 2;
+                if (Odds(mid) >= sel)
+                    r = mid + 1;
+                else
+                    end = mid;
+            }
+            if (r == config.card || (r > 0 && Odds(r - 1) - sel < sel - Odds(r)))
+                --r;
+            int last = r;
+            while (last + 1 < config.card && Odds(last + 1) > Odds(r) * 0.9)
+                ++last;
+            return name + " = '" + Value(r + (int)Below((uint32_t)(last - r + 1))) + "'";
+        }
+        // The most common ranks come first, so '<' takes a head of the odds
+        // and '>=' a tail; either when both come close
+        int head = Cut(sel), tail = Cut(1 - sel);
+        double head_err = std::fabs(Head(head) - sel) / sel, tail_err = std::fabs(1 - Head(tail) - sel) / sel;
+        bool use_head = head_err < 0.2 && tail_err < 0.2 ? Below(2) == 0 : head_err <= tail_err;
+        return name + (use_head ? " < " + std::to_string(head) : " >= " + std::to_string(tail));
+    }
+
+public:
+    inline explicit Generator(const Config &config_) : config(config_), rng(config_.seed) {
+        // The schema draws first, so rows and rules of a seed share it
+        for (int i = 0; i < config.attrs; ++i)
+            is_string.push_back(Uniform() < config.strings);
+        double sum = 0;
+        for (int r = 0; r < config.card; ++r) {
+            sum += 1 / std::pow(r + 1.0, config.zipf);
+            cdf.push_back(sum);
+        }
+        for (double &c: cdf)
+            c /= sum;
+        for (int r = 0; r < config.card; ++r) {
+            strs.push_back("\"" + Value(r) + "\"");
+            nums.push_back(std::to_string(r));
+        }
+        rng.seed(config.seed + (config.mode == "rows" ? 1 : 2));
+    }
+
+    void Row(std::string &out) {
+        out = "{";
+        for (int i = 0; i < config.attrs; ++i) {
+            if (Uniform() >= config.presence)
+                continue;
+            if (out.size() > 1)
+                out += ", ";
+            int rank = Rank();
+            out += "\"a";
+            out += std::to_string(i);
+            out += "\": ";
+            out += is_string[i] ? strs[rank] : nums[rank];
+        }
+        out += "}";
+    }
+
+    void Rule(std::string &out) {
+        int n = 1 + (int)Below((uint32_t)config.preds);
+        vector<int> attrs;
+        for (int i = 0; i < config.attrs; ++i)
+            attrs.push_back(i);
+        out.clear();
+        int clause = 0;
+        for (int i = 0; i < n && i < config.attrs; ++i) {
+            std::swap(attrs[i], attrs[i + Below((uint32_t)(config.attrs - i))]);
+            double sel = config.sel_lo * std::pow(config.sel_hi / config.sel_lo, Uniform());
+            if (i > 0) {
+                if (config.op == "mixed" && clause > 0 && Below(2) == 0) {
+                    out += ") | (";
+                    clause = 0;
+                } else {
+                    out += config.op == "or" ? " | " : " & ";
+                }
+            } else if (config.op == "mixed") {
+                out += "(";
+            }
+            out += Predicate(attrs[i], sel);
+            ++clause;
+        }
+        if (config.op == "mixed")
+            out += ")";
+    }
+};
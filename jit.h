@@ -0,0 +1,463 @@
+#pragma once
+
+#include <cmath>
+#include <cstddef>
+#include <random>
+
+#include "expression.h"
+
+#if defined(__x86_64__) && defined(__linux__)
+#define EXPRESSION_JIT 1
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// Native x86-64 code for a compiled Program, for rules run so often that
+// the dispatch of Program::Run shows. Every instruction becomes inline code:
+// a load of the slot type, the compare against the immediate constant for
+// each row type, and real branches for the jumps of '&' and '|'. Compares of
+// two parameters or two Bools call back into Program::Compare.
+//
+// The code is compiled once from the Program as it is then, so a Program
+// reordered later (see Expressions::Adapt) needs a new Jit. Where no code can
+// be made (another CPU, or a system refusing executable memory) Run falls
+// back to Program::Run, with the same results.
+//
+// Run only reads the Jit, so threads can share one like the Expressions.
+//
+// Usage:
+//     Jit jit(exp.Compiled());
+//     Expressions::Context ctx;
+//     exp.Load(row, ctx);
+//     bool matched = jit.Run(ctx.slots.data(), ctx.regs.data()).ans != Expression::False;
+class Jit {
+    using Bool = Expression::Bool;
+    using CmpOp = Expression::CmpOp;
+
+    using PropValInt = Expression::PropValInt;
+    using PropValFloat = Expression::PropValFloat;
+
+    using Entry = uint8_t (*)(const Slot *slots, Bool *regs);
+
+    const Program &program;
+    void *memory;
+    size_t size;
+    Entry native;
+
+    inline static uint8_t CompareSlots(const Slot *a, const Slot *b, uint32_t op) {
+        return (uint8_t)Program::Compare(*a, (CmpOp)op, *b).ans;
+    }
+    inline static uint8_t CompareBools(uint32_t a, uint32_t b, uint32_t op) {
+        return (uint8_t)Program::Compare(Bool((Expression::ReturnType)a), (CmpOp)op, Bool((Expression::ReturnType)b)).ans;
+    }
+
+#ifdef EXPRESSION_JIT
+    static_assert(sizeof(Slot) == 8 && offsetof(Slot, val_int) == 4, "Slot layout");
+    static_assert(sizeof(Bool) == 4, "Bool layout");
+
+    // Encoder for the few instructions used. Slots are addressed off rbx and
+    // registers off r12, both with a 32-bit displacement.
+    class Assembler {
+    public:
+        enum Base {
+            Rbx = 3,
+            R12 = 4,
+        };
+        // Condition codes, as in jcc and setcc
+        enum Cond : uint8_t {
+            B = 0x2,
+            AE = 0x3,
+            E = 0x4,
+            NE = 0x5,
+            BE = 0x6,
+            A = 0x7,
+            NP = 0xB,
+            L = 0xC,
+            GE = 0xD,
+            LE = 0xE,
+            G = 0xF,
+        };
+
+        vector<uint8_t> bytes;
+
+        inline void Byte(const uint8_t &b) {
+            bytes.push_back(b);
+        }
+        inline void Bytes(std::initializer_list<uint8_t> list) {
+            bytes.insert(bytes.end(), list);
+        }
+        inline void Dword(const uint32_t &v) {
+            for (int i = 0; i < 4; ++i)
+                Byte((uint8_t)(v >> (8 * i)));
+        }
+
+        // [prefix] [REX] opcode modrm(reg, [base + disp32])
+        inline void Mem(std::initializer_list<uint8_t> op, const uint8_t &reg, const Base &base, const int32_t &disp,
+                        const uint8_t &rex = 0, const uint8_t &prefix = 0) {
+            if (prefix != 0)
+                Byte(prefix);
+            uint8_t r = rex | (base == R12 ? 0x41 : 0);
+            if (r != 0)
+                Byte(r | 0x40);
+            Bytes(op);
+            Byte((uint8_t)(0x80 | (reg << 3) | base));
+            if (base == R12)
+                Byte(0x24);
+            Dword((uint32_t)disp);
+        }
+
+        // movzx r32, byte [base + disp]
+        inline void LoadByte(const uint8_t &reg, const Base &base, const int32_t &disp) {
+            Mem({0x0F, 0xB6}, reg, base, disp);
+        }
+        inline void CmpByte(const Base &base, const int32_t &disp, const uint8_t &imm) {
+            Mem({0x80}, 7, base, disp);
+            Byte(imm);
+        }
+        inline void CmpDword(const Base &base, const int32_t &disp, const uint32_t &imm) {
+            Mem({0x81}, 7, base, disp);
+            Dword(imm);
+        }
+        inline void StoreByte(const uint8_t &reg, const Base &base, const int32_t &disp) {
+            Mem({0x88}, reg, base, disp);
+        }
+        inline void StoreImm(const Base &base, const int32_t &disp, const uint8_t &imm) {
+            Mem({0xC6}, 0, base, disp);
+            Byte(imm);
+        }
+        // movss xmm0, [base + disp]
+        inline void LoadFloat(const Base &base, const int32_t &disp) {
+            Mem({0x0F, 0x10}, 0, base, disp, 0, 0xF3);
+        }
+        // cvtsi2ss xmm0, dword [base + disp]
+        inline void LoadIntAsFloat(const Base &base, const int32_t &disp) {
+            Mem({0x0F, 0x2A}, 0, base, disp, 0, 0xF3);
+        }
+        // xmm1 = val
+        inline void FloatConst(const PropValFloat &val) {
+            uint32_t bits;
+            memcpy(&bits, &val, sizeof(bits));
+            Byte(0xB8);
+            Dword(bits);
+            Bytes({0x66, 0x0F, 0x6E, 0xC8});
+        }
+        // cmp al, imm
+        inline void CmpAl(const uint8_t &imm) {
+            Bytes({0x3C, imm});
+        }
+        // setcc r8, for cl (1) or dl (2)
+        inline void Set(const Cond &cc, const uint8_t &reg) {
+            Bytes({0x0F, (uint8_t)(0x90 | cc), (uint8_t)(0xC0 | reg)});
+        }
+        // and cl, dl
+        inline void AndClDl() {
+            Bytes({0x20, 0xD1});
+        }
+
+        // Jumps with a rel32 to patch, returning where it is
+        inline size_t Jump(const Cond &cc) {
+            Bytes({0x0F, (uint8_t)(0x80 | cc)});
+            Dword(0);
+            return bytes.size() - 4;
+        }
+        inline size_t Jump() {
+            Byte(0xE9);
+            Dword(0);
+            return bytes.size() - 4;
+        }
+        inline void Patch(const size_t &at, const size_t &target) {
+            uint32_t rel = (uint32_t)((int64_t)target - (int64_t)(at + 4));
+            memcpy(&bytes[at], &rel, sizeof(rel));
+        }
+
+        // mov rax, fn; call rax
+        inline void Call(const void *fn) {
+            uint64_t addr = (uint64_t)(uintptr_t)fn;
+            Bytes({0x48, 0xB8});
+            Dword((uint32_t)addr);
+            Dword((uint32_t)(addr >> 32));
+            Bytes({0xFF, 0xD0});
+        }
+    };
+
+    inline static int32_t Type(const uint16_t &slot) {
+        return (int32_t)slot * 8;
+    }
+    inline static int32_t Value(const uint16_t &slot) {
+        return (int32_t)slot * 8 + 4;
+    }
+    inline static int32_t Reg(const uint16_t &reg) {
+        return (int32_t)reg * 4;
+    }
+
+    // Sets reg (cl or dl) to 'xmm0 op xmm1', with C++'s results on NaN; '='
+    // uses both and leaves its result in cl
+    inline static void FloatCmp(Assembler &as, const CmpOp &op, const uint8_t &reg) {
+        bool swap = op == Expression::Le || op == Expression::Lt;
+        as.Bytes({0x0F, 0x2E, (uint8_t)(swap ? 0xC8 : 0xC1)});
+        switch (op) {
+            case Expression::Eq:
+                as.Set(Assembler::E, 1);
+                as.Set(Assembler::NP, 2);
+                as.AndClDl();
+                break;
+            case Expression::Ge:
+            case Expression::Le:
+                as.Set(Assembler::AE, reg);
+                break;
+            default:
+                as.Set(Assembler::A, reg);
+        }
+    }
+
+    inline static Assembler::Cond Signed(const CmpOp &op) {
+        static const Assembler::Cond conds[] = {Assembler::E, Assembler::GE, Assembler::LE, Assembler::G, Assembler::L};
+        return conds[op];
+    }
+    inline static Assembler::Cond Unsigned(const CmpOp &op) {
+        static const Assembler::Cond conds[] = {Assembler::E, Assembler::AE, Assembler::BE, Assembler::A, Assembler::B};
+        return conds[op];
+    }
+
+    // cl = slots[a] <op> val into reg, for an int or a float slot; the caller
+    // handles the other types
+    inline static void IntCase(Assembler &as, const uint16_t &a, const CmpOp &op, const PropValInt &val, const uint8_t &reg) {
+        as.CmpDword(Assembler::Rbx, Value(a), (uint32_t)val);
+        as.Set(Signed(op), reg);
+    }
+    inline static void FloatCase(Assembler &as, const uint16_t &a, const bool &int_slot, const CmpOp &op,
+                                 const PropValFloat &val, const uint8_t &reg) {
+        if (int_slot)
+            as.LoadIntAsFloat(Assembler::Rbx, Value(a));
+        else
+            as.LoadFloat(Assembler::Rbx, Value(a));
+        as.FloatConst(val);
+        FloatCmp(as, op, reg);
+    }
+
+    // A compare of slots[a] with constants, into regs[dst]: int and float
+    // rows run the given cases, strings are False and missing values True.
+    template <typename IntRow, typename FloatRow>
+    inline static void Numeric(Assembler &as, const Instruction &ins, const IntRow &int_row, const FloatRow &float_row) {
+        as.LoadByte(0, Assembler::Rbx, Type(ins.a));
+        as.CmpAl(Expression::PropInt);
+        size_t not_int = as.Jump(Assembler::NE);
+        int_row();
+        size_t done_int = as.Jump();
+        as.Patch(not_int, as.bytes.size());
+        as.CmpAl(Expression::PropFloat);
+        size_t not_float = as.Jump(Assembler::NE);
+        float_row();
+        size_t done_float = as.Jump();
+        as.Patch(not_float, as.bytes.size());
+        as.CmpAl(Expression::PropNone);
+        as.Set(Assembler::E, 1);
+        as.Patch(done_int, as.bytes.size());
+        as.Patch(done_float, as.bytes.size());
+        // cl is 0 or 1, Bool False or True is 1 or 2
+        as.Bytes({0x80, 0xC1, 0x01});
+        as.StoreByte(1, Assembler::R12, Reg(ins.dst));
+    }
+
+    inline static void Emit(Assembler &as, const Instruction &ins) {
+        CmpOp op = ins.Op();
+        if (ins.code < Instruction::CmpFloat) {
+            Numeric(as, ins, [&]() { IntCase(as, ins.a, op, ins.val_int, 1); },
+                    [&]() { FloatCase(as, ins.a, false, op, (PropValFloat)ins.val_int, 1); });
+        } else if (ins.code < Instruction::CmpString) {
+            Numeric(as, ins, [&]() { FloatCase(as, ins.a, true, op, ins.val_float, 1); },
+                    [&]() { FloatCase(as, ins.a, false, op, ins.val_float, 1); });
+        } else if (ins.code < Instruction::CmpParam) {
+            as.LoadByte(0, Assembler::Rbx, Type(ins.a));
+            as.CmpAl(Expression::PropString);
+            size_t other = as.Jump(Assembler::NE);
+            as.CmpDword(Assembler::Rbx, Value(ins.a), ins.val_string);
+            as.Set(Unsigned(op), 1);
+            size_t done = as.Jump();
+            as.Patch(other, as.bytes.size());
+            as.CmpAl(Expression::PropNone);
+            as.Set(Assembler::E, 1);
+            as.Patch(done, as.bytes.size());
+            as.Bytes({0x80, 0xC1, 0x01});
+            as.StoreByte(1, Assembler::R12, Reg(ins.dst));
+        } else if (ins.code < Instruction::CmpBool) {
+            // lea rdi, slots[a]; lea rsi, slots[b]
+            as.Mem({0x8D}, 7, Assembler::Rbx, Type(ins.a), 0x48);
+            as.Mem({0x8D}, 6, Assembler::Rbx, Type(ins.b), 0x48);
+            as.Byte(0xBA);
+            as.Dword(op);
+            as.Call((const void *)&CompareSlots);
+            as.StoreByte(0, Assembler::R12, Reg(ins.dst));
+        } else if (ins.code < Instruction::Load) {
+            as.LoadByte(7, Assembler::R12, Reg(ins.a));
+            as.LoadByte(6, Assembler::R12, Reg(ins.b));
+            as.Byte(0xBA);
+            as.Dword(op);
+            as.Call((const void *)&CompareBools);
+            as.StoreByte(0, Assembler::R12, Reg(ins.dst));
+        } else if (ins.code == Instruction::Load) {
+            as.StoreImm(Assembler::R12, Reg(ins.dst), (uint8_t)ins.val_bool);
+        } else if (ins.code == Instruction::And || ins.code == Instruction::Or) {
+            // Undefined takes the other side, else '&' is the smaller of
+            // False (1) and True (2) and '|' the larger
+            as.LoadByte(0, Assembler::R12, Reg(ins.dst));
+            as.LoadByte(1, Assembler::R12, Reg(ins.a));
+            as.Bytes({0x85, 0xC0});
+            size_t take = as.Jump(Assembler::E);
+            as.Bytes({0x85, 0xC9});
+            size_t keep = as.Jump(Assembler::E);
+            as.Bytes({0x39, 0xC1, 0x0F, (uint8_t)(ins.code == Instruction::And ? 0x42 : 0x47), 0xC1});
+            size_t done = as.Jump();
+            as.Patch(take, as.bytes.size());
+            as.Bytes({0x89, 0xC8});
+            as.Patch(keep, as.bytes.size());
+            as.Patch(done, as.bytes.size());
+            as.StoreByte(0, Assembler::R12, Reg(ins.dst));
+        } else if (ins.code == Instruction::RangeInt || ins.code == Instruction::RangeFloat) {
+            CmpOp lo = ins.b & Instruction::LowOpen ? Expression::Gt : Expression::Ge;
+            CmpOp hi = ins.b & Instruction::HighOpen ? Expression::Lt : Expression::Le;
+            if (ins.code == Instruction::RangeInt) {
+                Numeric(as, ins, [&]() {
+                    IntCase(as, ins.a, lo, ins.val_int, 1);
+                    IntCase(as, ins.a, hi, ins.hi_int, 2);
+                    as.AndClDl();
+                }, [&]() {
+                    FloatCase(as, ins.a, false, lo, (PropValFloat)ins.val_int, 1);
+                    FloatCase(as, ins.a, false, hi, (PropValFloat)ins.hi_int, 2);
+                    as.AndClDl();
+                });
+            } else {
+                Numeric(as, ins, [&]() {
+                    FloatCase(as, ins.a, true, lo, ins.val_float, 1);
+                    FloatCase(as, ins.a, true, hi, ins.hi_float, 2);
+                    as.AndClDl();
+                }, [&]() {
+                    FloatCase(as, ins.a, false, lo, ins.val_float, 1);
+                    FloatCase(as, ins.a, false, hi, ins.hi_float, 2);
+                    as.AndClDl();
+                });
+            }
+        } else {
+            assert(ins.code == Instruction::JumpFalse || ins.code == Instruction::JumpTrue);
+        }
+    }
+
+    inline void Compile() {
+        Assembler as;
+        // push rbx; push r12; sub rsp, 8; mov rbx, rdi; mov r12, rsi
+        as.Bytes({0x53, 0x41, 0x54, 0x48, 0x83, 0xEC, 0x08, 0x48, 0x89, 0xFB, 0x49, 0x89, 0xF4});
+
+        const vector<Instruction> &code = program.code;
+        vector<size_t> starts;
+        vector<std::pair<size_t, uint32_t>> jumps;
+        for (const Instruction &ins: code) {
+            starts.push_back(as.bytes.size());
+            if (ins.code == Instruction::JumpFalse || ins.code == Instruction::JumpTrue) {
+                as.CmpByte(Assembler::R12, Reg(ins.dst), ins.code == Instruction::JumpFalse ? Expression::False : Expression::True);
+                jumps.emplace_back(as.Jump(Assembler::E), ins.target);
+            } else {
+                Emit(as, ins);
+            }
+        }
+        starts.push_back(as.bytes.size());
+        for (const auto &jump: jumps)
+            as.Patch(jump.first, starts[jump.second]);
+
+        // movzx eax, byte [r12]; add rsp, 8; pop r12; pop rbx; ret
+        as.LoadByte(0, Assembler::R12, 0);
+        as.Bytes({0x48, 0x83, 0xC4, 0x08, 0x41, 0x5C, 0x5B, 0xC3});
+
+        size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        size = (as.bytes.size() + page - 1) / page * page;
+        memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED) {
+            memory = nullptr;
+            return;
+        }
+        memcpy(memory, as.bytes.data(), as.bytes.size());
+        if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) {
+            munmap(memory, size);
+            memory = nullptr;
+            return;
+        }
+        native = (Entry)memory;
+    }
+#endif
+
+public:
+    inline explicit Jit(const Program &program_) : program(program_), memory(nullptr), size(0), native(nullptr) {
+#ifdef EXPRESSION_JIT
+        Compile();
+#endif
+    }
+    inline ~Jit() {
+#ifdef EXPRESSION_JIT
+        if (memory != nullptr)
+            munmap(memory, size);
+#endif
+    }
+    Jit(const Jit &) = delete;
+    Jit & operator = (const Jit &) = delete;
+
+    // Whether Run executes native code rather than Program::Run
+    inline bool Native() const {
+        return native != nullptr;
+    }
+
+    // Program::Run; regs needs program.registers entries
+    inline Bool Run(const Slot *slots, Bool *regs) const {
+        if (native == nullptr)
+            return program.Run(slots, regs);
+        return Bool((Expression::ReturnType)native(slots, regs));
+    }
+
+    // Runs Program::Run and the native code on rows random rows, drawn around
+    // the constants of the program with some values missing, strings and
+    // NaN, and returns on how many they disagree.
+    size_t Check(const size_t &rows, const uint32_t &seed = 1) const {
+        std::mt19937 rng(seed);
+        vector<int32_t> ints{0, 1, -1};
+        vector<HashCode> strings{0, 1};
+        for (const Instruction &ins: program.code) {
+            if (ins.code < Instruction::CmpFloat || ins.code == Instruction::RangeInt) {
+                ints.push_back(ins.val_int);
+                if (ins.code == Instruction::RangeInt)
+                    ints.push_back(ins.hi_int);
+            } else if (ins.code < Instruction::CmpString || ins.code == Instruction::RangeFloat) {
+                ints.push_back((int32_t)ins.val_float);
+                if (ins.code == Instruction::RangeFloat)
+                    ints.push_back((int32_t)ins.hi_float);
+            } else if (ins.code < Instruction::CmpParam) {
+                strings.push_back(ins.val_string);
+            }
+        }
+
+        size_t registers = program.registers;
+        vector<Slot> slots(program.params.size());
+        vector<Bool> expected(registers, Bool(Expression::Undefined));
+        vector<Bool> actual(registers, Bool(Expression::Undefined));
+        size_t bad = 0;
+        for (size_t row = 0; row < rows; ++row) {
+            for (Slot &slot: slots) {
+                int32_t near = ints[rng() % ints.size()] + (int32_t)(rng() % 3) - 1;
+                switch (rng() % 6) {
+                    case 0:
+                        slot.Clear();
+                        break;
+                    case 1:
+                        slot.Assign(strings[rng() % strings.size()] + (HashCode)(rng() % 2));
+                        break;
+                    case 2:
+                    case 3:
+                        slot.Assign((PropValInt)near);
+                        break;
+                    default:
+                        slot.Assign(rng() % 16 == 0 ? (PropValFloat)NAN : (PropValFloat)near + (PropValFloat)(rng() % 3) * 0.25f);
+                }
+            }
+            if (program.Run(slots.data(), expected.data()).ans != Run(slots.data(), actual.data()).ans)
+                ++bad;
+        }
+        return bad;
+    }
+};
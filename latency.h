@@ -0,0 +1,229 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Log-linear histogram of durations in nanoseconds, as in HdrHistogram: every
+// power of two is cut into 2^Sub buckets of equal width, so a value is kept
+// to within 1/2^Sub (about 3%) of itself, from 1 ns up to 2^Bits ns (over an
+// hour; longer ones count as that). One thread records into a Histogram, and
+// others may read it meanwhile: counts are atomics the recording thread
+// bumps with a relaxed load and store, never a locked read-modify-write.
+class Histogram {
+public:
+    static const int Sub = 5;
+    static const int Bits = 42;
+    static const size_t Buckets = (size_t)(Bits - Sub + 1) << Sub;
+
+private:
+    std::atomic<uint64_t> counts[Buckets];
+    std::atomic<uint64_t> total;
+    std::atomic<uint64_t> sum;
+
+    inline static void Bump(std::atomic<uint64_t> &x, const uint64_t &by) {
+        x.store(x.load(std::memory_order_relaxed) + by, std::memory_order_relaxed);
+    }
+
+public:
+    inline Histogram() {
+        Clear();
+    }
+    Histogram(const Histogram &) = delete;
+    Histogram & operator = (const Histogram &) = delete;
+
+    // Bucket of a value: values below 2^Sub have one each, above that the
+    // top Sub bits after the leading one pick the bucket within its power
+    inline static size_t Index(uint64_t ns) {
+        ns = std::min<uint64_t>(ns, (1ULL << Bits) - 1);
+        if (ns < 1ULL << Sub)
+            return (size_t)ns;
+        int e = 63 - __builtin_clzll(ns);
+        return (size_t)(e - Sub + 1) << Sub | (size_t)(ns >> (e - Sub) & ((1ULL << Sub) - 1));
+    }
+    // Largest value of a bucket
+    inline static uint64_t High(const size_t &bucket) {
+        if (bucket < 1ULL << Sub)
+            return bucket;
+        int shift = (int)(bucket >> Sub) - 1;
+        uint64_t low = ((1ULL << Sub) | (bucket & ((1ULL << Sub) - 1))) << shift;
+        return low + (1ULL << shift) - 1;
+    }
+
+    // Not while a thread records
+    inline void Clear() {
+        for (std::atomic<uint64_t> &count: counts)
+            count.store(0, std::memory_order_relaxed);
+        total.store(0, std::memory_order_relaxed);
+        sum.store(0, std::memory_order_relaxed);
+    }
+
+    inline void Record(const uint64_t &ns) {
+        Bump(counts[Index(ns)], 1);
+        Bump(total, 1);
+        Bump(sum, ns);
+    }
+
+    // Adds another Histogram, which may be recording, into this one, which
+    // must not be
+    inline void Add(const Histogram &other) {
+        for (size_t i = 0; i < Buckets; ++i)
+            Bump(counts[i], other.counts[i].load(std::memory_order_relaxed));
+        Bump(total, other.total.load(std::memory_order_relaxed));
+        Bump(sum, other.sum.load(std::memory_order_relaxed));
+    }
+
+    inline uint64_t Count() const {
+        return total.load(std::memory_order_relaxed);
+    }
+    inline uint64_t Sum() const {
+        return sum.load(std::memory_order_relaxed);
+    }
+
+    // The value at quantile q in [0, 1], as the largest value of its bucket
+    // so it is never reported lower than it was; 0 when empty
+    uint64_t Quantile(const double &q) const {
+        uint64_t n = Count();
+        if (n == 0)
+            return 0;
+        auto rank = (uint64_t)(q * n + 0.5);
+        rank = std::max<uint64_t>(1, std::min(rank, n));
+        uint64_t seen = 0;
+        size_t last = 0;
+        for (size_t i = 0; i < Buckets; ++i) {
+            uint64_t count = counts[i].load(std::memory_order_relaxed);
+            if (count == 0)
+                continue;
+            last = i;
+            seen += count;
+            if (seen >= rank)
+                return High(i);
+        }
+        // Counts bumped since Count was read
+        return High(last);
+    }
+};
+
+// Per-thread Histograms of one duration, such as Match calls or batches:
+// shard i is recorded by one thread only, and Merge sums the shards on
+// demand, while they record. Each shard is a separate allocation of some
+// 10 KB, so threads do not write to each other's cache lines.
+//
+// Reading the clock costs about as much as matching a small row, so a
+// recorder may sample: a shard then times one call in every. Counts and
+// sums are of the timed calls only.
+//
+// Usage:
+//     LatencyRecorder latency(1);
+//     {
+//         LatencyRecorder::Timer timer(&latency, 0);
+//         matched = exp.Match(row, ctx);
+//     }
+//     std::string text;
+//     latency.Text("expression_match_seconds", "Match latency", text);
+class LatencyRecorder {
+    using Clock = std::chrono::steady_clock;
+
+    struct Shard {
+        Histogram histogram;
+        uint32_t skipped = 0;
+    };
+
+    std::vector<std::unique_ptr<Shard>> shards;
+    uint32_t every;
+
+public:
+    // Times its scope on a shard of a recorder, if the shard samples this
+    // call; a nullptr recorder times nothing
+    class Timer {
+        LatencyRecorder *recorder;
+        size_t shard;
+        Clock::time_point start;
+
+    public:
+        inline Timer(LatencyRecorder *recorder_, const size_t &shard_) : recorder(recorder_), shard(shard_) {
+            if (recorder != nullptr && !recorder->Sample(shard))
+                recorder = nullptr;
+            if (recorder != nullptr)
+                start = Clock::now();
+        }
+        inline ~Timer() {
+            if (recorder != nullptr)
+                recorder->Record(shard, (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    Clock::now() - start).count());
+        }
+        Timer(const Timer &) = delete;
+        Timer & operator = (const Timer &) = delete;
+    };
+
+    inline explicit LatencyRecorder(const size_t &shards_, const uint32_t &every_ = 1) :
+        every(std::max(1U, every_)) {
+        for (size_t i = 0; i < std::max<size_t>(1, shards_); ++i)
+            shards.emplace_back(new Shard());
+    }
+
+    inline size_t Shards() const {
+        return shards.size();
+    }
+
+    // Whether the shard times its next call, one in every
+    inline bool Sample(const size_t &shard) {
+        Shard &own = *shards[shard];
+        if (++own.skipped < every)
+            return false;
+        own.skipped = 0;
+        return true;
+    }
+
+    inline void Record(const size_t &shard, const uint64_t &ns) {
+        shards[shard]->histogram.Record(ns);
+    }
+
+    // Sums the shards into out, which starts empty
+    inline void Merge(Histogram &out) const {
+        out.Clear();
+        for (const std::unique_ptr<Shard> &shard: shards)
+            out.Add(shard->histogram);
+    }
+
+    // Not while a thread records
+    inline void Clear() {
+        for (std::unique_ptr<Shard> &shard: shards) {
+            shard->histogram.Clear();
+            shard->skipped = 0;
+        }
+    }
+
+    // Appends the merged durations to out as a Prometheus summary, in
+    // seconds: quantiles, then _sum and _count
+    void Text(const std::string &name, const std::string &help, std::string &out) const {
+        static const double quantiles[] = {0.5, 0.9, 0.99, 0.999, 1};
+        std::unique_ptr<Histogram> merged(new Histogram());
+        Merge(*merged);
+        std::ostringstream w;
+        w << "# HELP " << name << " " << help << "\n";
+        w << "# TYPE " << name << " summary\n";
+        for (const double &q: quantiles)
+            w << name << "{quantile=\"" << q << "\"} " << merged->Quantile(q) * 1e-9 << "\n";
+        w << name << "_sum " << merged->Sum() * 1e-9 << "\n";
+        w << name << "_count " << merged->Count() << "\n";
+        out += w.str();
+    }
+
+    // Writes Text to a file, replacing it; false on failure with errno set
+    bool Write(const char *path, const std::string &name, const std::string &help) const {
+        std::string text;
+        Text(name, help, text);
+        FILE *file = fopen(path, "w");
+        if (file == nullptr)
+            return false;
+        bool ok = fwrite(text.data(), 1, text.size(), file) == text.size();
+        return fclose(file) == 0 && ok;
+    }
+};
@@ -1,7 +1,14 @@
 #include <iostream>
-#include <iomanip>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "rapidjson/document.h"
 #include "expression.h"
+#include "jit.h"
+#include "parallel.h"
+#include "saxmatch.h"
+#include "staticexp.h"
 
 struct Dict {
 public:
@@ -31,10 +38,11 @@ public:
             auto type = it->value.GetType();
             if (type == rapidjson::kStringType)
                 return Expression::PropString;
-            if (type == rapidjson::kNumberType && it->value.IsDouble())
-                return Expression::PropFloat;
-            if (type == rapidjson::kNumberType)
+            // Integers beyond an int are read as floats, as SaxMatcher does
+            if (type == rapidjson::kNumberType && it->value.IsInt())
                 return Expression::PropInt;
+            if (type == rapidjson::kNumberType)
+                return Expression::PropFloat;
             return Expression::PropNone;
         }
         inline const char * Name() {
@@ -70,10 +78,121 @@ public:
     }
 };
 
-int main() {
+STATIC_EXPRESSION(Demo, "(brand = 'Apple' & price > 6000) | (brand = 'HW' & price > 5000)");
+
+// ./expression --jit-check [expression [rows]]: runs the JIT and the
+// interpreter on random rows and reports how often they disagree
+int JitCheck(const char *expression, const size_t &rows) {
+    Expressions exp;
+    exp.Parse(expression);
+    Jit jit(exp.Compiled());
+    std::cout << exp.Compiled();
+    if (!jit.Native())
+        std::cout << "no native code, checking the interpreter fallback" << std::endl;
+    size_t bad = jit.Check(rows);
+    std::cout << rows << " rows, " << bad << " mismatches" << std::endl;
+    return bad == 0 ? 0 : 1;
+}
+
+// ./expression --filter expression file [--offsets] [--threads n]
+// [--metrics out]: writes the lines of an NDJSON file matching expression,
+// or their byte offsets. Lines are written as they are, "\r\n" included,
+// and a last line without an end gets a '\n'. The file is mapped read-only
+// and every line parsed in place with SAX, so row bytes are never copied,
+// only written out. With --metrics, the latency of rows (one in 64) and of
+// blocks goes to out in the Prometheus text format.
+int Filter(const char *expression, const char *path, const bool &offsets, const size_t &threads,
+           const char *metrics) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror(path);
+        return 2;
+    }
+    size_t size = (size_t)st.st_size;
+    if (size == 0)
+        return 0;
+    auto *data = (const char *)mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        perror(path);
+        return 2;
+    }
+    madvise((void *)data, size, MADV_SEQUENTIAL);
+
+    Expressions exp;
+    exp.Parse(expression);
+    WorkPool pool(threads);
+    ParallelMatcher matcher(exp, pool);
+    LatencyRecorder row_times(pool.Size(), 64);
+    LatencyRecorder block_times(1);
+    if (metrics != nullptr)
+        matcher.Time(&row_times, &block_times);
+
+    // Blocks of whole lines keep the line table and bitmap small on big files
+    const size_t block = 64 << 20;
+    vector<ParallelMatcher::Row> rows;
+    vector<uint64_t> matched;
+    vector<size_t> hits;
+    for (size_t begin = 0; begin < size; ) {
+        size_t end = std::min(size, begin + block);
+        if (end < size) {
+            auto *eol = (const char *)memchr(data + end, '\n', size - end);
+            end = eol == nullptr ? size : eol - data + 1;
+        }
+        ParallelMatcher::Lines(data + begin, end - begin, rows);
+        matcher.Match(rows, matched);
+        ParallelMatcher::Indices(matched, hits);
+        for (const size_t &i: hits) {
+            if (offsets) {
+                printf("%zu\n", (size_t)(rows[i].data - data));
+            } else {
+                // As in the file: Lines leaves the '\r' of "\r\n" out of the row
+                size_t len = rows[i].len;
+                if (rows[i].data + len < data + end && rows[i].data[len] == '\r')
+                    ++len;
+                fwrite(rows[i].data, 1, len, stdout);
+                putchar('\n');
+            }
+        }
+        begin = end;
+    }
+    munmap((void *)data, size);
+
+    if (metrics != nullptr) {
+        std::string text;
+        row_times.Text("expression_filter_row_seconds", "Time to match a row, one in 64 sampled", text);
+        block_times.Text("expression_filter_block_seconds", "Time to match a block of rows", text);
+        FILE *file = fopen(metrics, "w");
+        if (file == nullptr || fwrite(text.data(), 1, text.size(), file) != text.size() || fclose(file) != 0) {
+            perror(metrics);
+            return 2;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
     const char* expression = "(brand = 'Apple' & price > 6000) | (brand = 'HW' & price > 5000)";
     const char *data = R"({"brand": "Apple", "price": 5888.8})";
 
+    if (argc > 1 && strcmp(argv[1], "--jit-check") == 0)
+        return JitCheck(argc > 2 ? argv[2] : expression, argc > 3 ? strtoul(argv[3], nullptr, 10) : 1000000);
+    if (argc > 3 && strcmp(argv[1], "--filter") == 0) {
+        bool offsets = false;
+        size_t threads = 0;
+        const char *metrics = nullptr;
+        for (int i = 4; i < argc; ++i) {
+            if (strcmp(argv[i], "--offsets") == 0)
+                offsets = true;
+            else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+                threads = strtoul(argv[++i], nullptr, 10);
+            else if (strcmp(argv[i], "--metrics") == 0 && i + 1 < argc)
+                metrics = argv[++i];
+        }
+        return Filter(argv[2], argv[3], offsets, threads, metrics);
+    }
+
     Expressions exp;
     exp.Parse(expression);
     std::cout << exp << std::endl;
@@ -83,16 +202,8 @@ int main() {
 
     Dict d(row);
 
-    time_t start = clock(), end;
-    int testCases = 1000000;
-
-    for (int T = 0; T < testCases; T ++) {
-        bool matched = exp.Match(d);
-        printf("%d\n", matched);
-    }
-
-    end = clock();
-    std::cerr << std::fixed << std::setprecision(3) << (end - start + 0.0) / CLOCKS_PER_SEC << "s " << std::endl;
-
+    SaxMatcher sax(exp);
+    std::cout << "dom: " << exp.Match(d) << ", sax: " << sax.Match(data) << ", static: " << Demo::Match(d) << std::endl;
+    // Timing lives in bench.cpp, see 'make bench'
     return 0;
 }
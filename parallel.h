@@ -0,0 +1,239 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "rapidjson/memorystream.h"
+#include "counters.h"
+#include "latency.h"
+#include "saxmatch.h"
+
+// Fixed set of threads running data-parallel loops. Run deals the chunks of
+// a loop out in contiguous runs, one queue per worker; a worker takes its own
+// chunks from the front and, once out of them, steals from the back of the
+// others', so uneven chunks still keep every core busy. The calling thread
+// works as the last worker, and a pool of one runs everything inline.
+class WorkPool {
+    struct Queue {
+        std::mutex lock;
+        std::deque<size_t> chunks;
+    };
+
+    vector<std::thread> threads;
+    vector<std::unique_ptr<Queue>> queues;
+
+    std::mutex lock;
+    std::condition_variable wake;
+    std::condition_variable done;
+    std::function<void(size_t, size_t)> job;
+    uint64_t generation;
+    size_t busy;
+    bool stop;
+
+    inline bool Next(const size_t &worker, size_t &chunk) {
+        {
+            Queue &own = *queues[worker];
+            std::lock_guard<std::mutex> guard(own.lock);
+            if (!own.chunks.empty()) {
+                chunk = own.chunks.front();
+                own.chunks.pop_front();
+                return true;
+            }
+        }
+        for (size_t i = 1; i < queues.size(); ++i) {
+            Queue &other = *queues[(worker + i) % queues.size()];
+            std::lock_guard<std::mutex> guard(other.lock);
+            if (!other.chunks.empty()) {
+                chunk = other.chunks.back();
+                other.chunks.pop_back();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    inline void Work(const size_t &worker) {
+        size_t chunk;
+        while (Next(worker, chunk))
+            job(worker, chunk);
+    }
+
+    void Loop(const size_t worker) {
+        uint64_t seen = 0;
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                wake.wait(guard, [&]() { return stop || generation != seen; });
+                if (stop)
+                    return;
+                seen = generation;
+            }
+            Work(worker);
+            std::lock_guard<std::mutex> guard(lock);
+            if (--busy == 0)
+                done.notify_all();
+        }
+    }
+
+public:
+    // 0 workers means one per hardware thread
+    inline explicit WorkPool(size_t workers = 0) : generation(0), busy(0), stop(false) {
+        if (workers == 0)
+            workers = std::max(1U, std::thread::hardware_concurrency());
+        for (size_t i = 0; i < workers; ++i)
+            queues.emplace_back(new Queue());
+        for (size_t i = 0; i + 1 < workers; ++i)
+            threads.emplace_back(&WorkPool::Loop, this, i);
+    }
+    inline ~WorkPool() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stop = true;
+        }
+        wake.notify_all();
+        for (std::thread &thread: threads)
+            thread.join();
+    }
+    WorkPool(const WorkPool &) = delete;
+    WorkPool & operator = (const WorkPool &) = delete;
+
+    // Workers, the calling thread included
+    inline size_t Size() const {
+        return queues.size();
+    }
+
+    // Calls fn(worker, chunk) once for every chunk in [0, chunks) and returns
+    // when all are done. Calls with the same worker never overlap, so fn may
+    // keep per-worker state indexed by it.
+    void Run(const size_t &chunks, const std::function<void(size_t, size_t)> &fn) {
+        size_t workers = queues.size();
+        for (size_t w = 0; w < workers; ++w) {
+            Queue &queue = *queues[w];
+            std::lock_guard<std::mutex> guard(queue.lock);
+            for (size_t chunk = chunks * w / workers; chunk < chunks * (w + 1) / workers; ++chunk)
+                queue.chunks.push_back(chunk);
+        }
+        job = fn;
+        if (!threads.empty()) {
+            std::lock_guard<std::mutex> guard(lock);
+            ++generation;
+            busy = threads.size();
+        }
+        wake.notify_all();
+        Work(workers - 1);
+        std::unique_lock<std::mutex> guard(lock);
+        done.wait(guard, [&]() { return busy == 0; });
+    }
+};
+
+// Matches large batches of JSON rows against one Expressions on a WorkPool.
+// Rows are cut into chunks of grain rows, a multiple of 64. Every worker
+// matches with a SaxMatcher of its own over the shared Expressions, and a
+// chunk writes only its own words of the result bitmap, so the bits come
+// out in input order with no merging or locking.
+//
+// Usage:
+//     WorkPool pool;
+//     ParallelMatcher matcher(exp, pool);
+//     vector<uint64_t> matched;
+//     matcher.Match(ndjson, len, matched);     // bit i for line i
+class ParallelMatcher {
+public:
+    // A row of a batch, not necessarily NUL-terminated
+    struct Row {
+        const char *data;
+        size_t len;
+    };
+
+private:
+    const Expressions &exp;
+    WorkPool &pool;
+    size_t grain;
+    vector<std::unique_ptr<SaxMatcher>> matchers;
+    vector<Row> lines;
+    // Where to time rows, a shard per worker, and batches; see Time
+    LatencyRecorder *row_times;
+    LatencyRecorder *batch_times;
+
+public:
+    inline ParallelMatcher(const Expressions &exp_, WorkPool &pool_, const size_t &grain_ = 4096) :
+        exp(exp_), pool(pool_), grain(std::max<size_t>(64, (grain_ + 63) / 64 * 64)), row_times(nullptr),
+        batch_times(nullptr) {
+        for (size_t i = 0; i < pool.Size(); ++i)
+            matchers.emplace_back(new SaxMatcher(exp));
+    }
+
+    // Counts predicate outcomes into counters, a shard per worker, or stops
+    // counting for nullptr
+    inline void Count(PredicateCounters *counters) {
+        assert(counters == nullptr || counters->Shards() >= matchers.size());
+        for (size_t i = 0; i < matchers.size(); ++i) {
+            if (counters == nullptr)
+                PredicateCounters::Detach(matchers[i]->State());
+            else
+                counters->Attach(matchers[i]->State(), i);
+        }
+    }
+
+    // Records how long rows take to match, each worker into its own shard of
+    // rows, and whole calls of Match into batches. Either may be nullptr.
+    inline void Time(LatencyRecorder *rows, LatencyRecorder *batches) {
+        assert(rows == nullptr || rows->Shards() >= matchers.size());
+        row_times = rows;
+        batch_times = batches;
+    }
+
+    // Cuts NDJSON into its lines, without the '\n' (or "\r\n"). Every line
+    // is a row, so row i is line i, empty ones included; a final '\n' does
+    // not start another line.
+    static void Lines(const char *data, const size_t &len, vector<Row> &out) {
+        out.clear();
+        const char *end = data + len;
+        while (data < end) {
+            auto *eol = (const char *)memchr(data, '\n', end - data);
+            const char *next = eol == nullptr ? end : eol + 1;
+            if (eol == nullptr)
+                eol = end;
+            if (eol > data && eol[-1] == '\r')
+                --eol;
+            out.push_back(Row{data, (size_t)(eol - data)});
+            data = next;
+        }
+    }
+
+    // Indices of the bits set in bitmap, in order
+    static void Indices(const vector<uint64_t> &bitmap, vector<size_t> &out) {
+        out.clear();
+        for (size_t w = 0; w < bitmap.size(); ++w)
+            for (uint64_t bits = bitmap[w]; bits != 0; bits &= bits - 1)
+                out.push_back(w * 64 + __builtin_ctzll(bits));
+    }
+
+    // Sets bit i of out, (rows.size() + 63) / 64 words, for every matching
+    // row i
+    void Match(const vector<Row> &rows, vector<uint64_t> &out) {
+        LatencyRecorder::Timer batch(batch_times, 0);
+        out.assign((rows.size() + 63) / 64, 0);
+        size_t chunks = (rows.size() + grain - 1) / grain;
+        pool.Run(chunks, [&](size_t worker, size_t chunk) {
+            SaxMatcher &matcher = *matchers[worker];
+            size_t end = std::min(rows.size(), (chunk + 1) * grain);
+            for (size_t i = chunk * grain; i < end; ++i) {
+                rapidjson::MemoryStream is(rows[i].data, rows[i].len);
+                LatencyRecorder::Timer timer(row_times, worker);
+                if (matcher.Match(is))
+                    out[i / 64] |= 1ULL << (i % 64);
+            }
+        });
+    }
+
+    // Matches every line of NDJSON, see Lines
+    inline void Match(const char *ndjson, const size_t &len, vector<uint64_t> &out) {
+        Lines(ndjson, len, lines);
+        Match(lines, out);
+    }
+};
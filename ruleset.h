@@ -0,0 +1,544 @@
+#pragma once
+
+#include <map>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+
+#include "expression.h"
+
+// Matches one row against many Expressions at once.
+//
+// Every atomic predicate 'param op constant' of every rule is interned once,
+// and indexed under its parameter: a hash table per constant for '=' and a
+// sorted constant list per operator for '>=', '<=', '>' and '<'. A row binds
+// its referenced parameters and walks the index of each of them to mark the
+// satisfied predicates.
+//
+// Most rules can match only if one of a few of their predicates holds, or
+// reads a parameter the row lacks (every comparison on a missing parameter
+// is True): 'a = 1 & b > 2' needs a = 1, and 'a = 1 | b = 2' either of its
+// two. Add finds such a set by running the program over sets of predicates,
+// taking the operand with fewer and more selective ones at an '&', and Match
+// evaluates a rule only when a predicate of its set holds or its parameter is
+// missing. The rest, rules with a bare value or a comparison of parameters
+// or of subexpressions that may match whatever the predicates, are evaluated
+// on every row carrying one of their parameters and decided up front on the
+// others.
+//
+// So a row costs the rules its satisfied predicates select, but also every
+// rule needing a parameter the row lacks, and every rule of the rest on its
+// parameters: rules reading optional parameters, or needing only wide
+// ranges, are evaluated often.
+//
+// Each rule keeps its own compiled Program, rewritten so that a predicate
+// compare reads a predicate slot holding 1 or 0 (or nothing when the
+// parameter is missing) filled from the shared index.
+//
+// Usage:
+//     RuleSet rules;
+//     rules.Add("brand = 'Apple' & price > 6000");
+//     rules.Add("brand = 'HW' & price > 5000");
+//     vector<RuleSet::RuleId> matched;
+//     rules.Match(row, matched);
+class RuleSet {
+public:
+    using RuleId = uint32_t;
+
+private:
+    using PredId = uint32_t;
+    using ParamId = uint32_t;
+    using Bool = Expression::Bool;
+    using CmpOp = Expression::CmpOp;
+
+    using PropValInt = Expression::PropValInt;
+    using PropValFloat = Expression::PropValFloat;
+
+    // Predicates of one parameter over constants of type T
+    template <typename T>
+    struct Index {
+        std::unordered_map<T, vector<PredId>> eq;
+        vector<std::pair<T, PredId>> ranges[5];
+        bool sorted;
+
+        inline Index(): sorted(true) {}
+
+        inline void Add(const CmpOp &op, const T &val, const PredId &pred) {
+            if (op == Expression::Eq) {
+                eq[val].push_back(pred);
+            } else {
+                ranges[op].emplace_back(val, pred);
+                sorted = false;
+            }
+        }
+
+        inline void Sort() {
+            if (sorted)
+                return;
+            for (auto &range: ranges)
+                std::sort(range.begin(), range.end());
+            sorted = true;
+        }
+
+        // Calls f on every predicate 'val op constant' that holds
+        template <typename F>
+        inline void Scan(const T &val, const F &f) const {
+            auto it = eq.find(val);
+            if (it != eq.end())
+                for (const PredId &pred: it->second)
+                    f(pred);
+
+            using Entry = std::pair<T, PredId>;
+            auto below = [](const Entry &e, const T &v) { return e.first < v; };
+            auto above = [](const T &v, const Entry &e) { return v < e.first; };
+
+            const vector<Entry> &ge = ranges[Expression::Ge];
+            for (auto p = ge.begin(), end = std::upper_bound(ge.begin(), ge.end(), val, above); p != end; ++p)
+                f(p->second);
+            const vector<Entry> &gt = ranges[Expression::Gt];
+            for (auto p = gt.begin(), end = std::lower_bound(gt.begin(), gt.end(), val, below); p != end; ++p)
+                f(p->second);
+            const vector<Entry> &le = ranges[Expression::Le];
+            for (auto p = std::lower_bound(le.begin(), le.end(), val, below); p != le.end(); ++p)
+                f(p->second);
+            const vector<Entry> &lt = ranges[Expression::Lt];
+            for (auto p = std::upper_bound(lt.begin(), lt.end(), val, above); p != lt.end(); ++p)
+                f(p->second);
+        }
+    };
+
+    struct Param {
+        HashCode name;
+        // Int constants for int rows, float constants for int rows and every
+        // numeric constant (as float) for float rows, see Program::Compare
+        Index<PropValInt> ints;
+        Index<PropValFloat> floats;
+        Index<PropValFloat> numbers;
+        Index<HashCode> strings;
+        // Rules that are evaluated on every row carrying it
+        vector<RuleId> rules;
+        // Rules needing a predicate on it, evaluated on rows lacking it
+        vector<RuleId> watchers;
+
+        inline explicit Param(const HashCode &name_) : name(name_) {}
+
+        inline void Sort() {
+            ints.Sort();
+            floats.Sort();
+            numbers.Sort();
+            strings.Sort();
+        }
+    };
+
+    struct Rule {
+        Program program;
+        // Local slots: one per predicate, then one per parameter compared
+        // with another parameter
+        vector<PredId> preds;
+        vector<ParamId> params;
+        bool fallback;
+    };
+
+    struct Pred {
+        ParamId param;
+        CmpOp op;
+        // Rules needing it, see Need
+        vector<RuleId> rules;
+    };
+
+    // Local predicate slots of a rule one of which holds, or reads a missing
+    // parameter, whenever a register is not False; any when there are none
+    struct Need {
+        bool any;
+        vector<uint16_t> slots;
+    };
+
+public:
+    // Per-row scratch of a Match, stamped with the row number instead of
+    // being cleared. Only Add changes a RuleSet, so threads can share a
+    // sorted one read-only, each matching with a Context of its own.
+    struct Context {
+        uint32_t row;
+        vector<uint32_t> seen;
+        vector<Slot> values;
+        vector<ParamId> present;
+        vector<uint32_t> satisfied;
+        vector<uint32_t> touched_at;
+        vector<RuleId> touched;
+        vector<Slot> slots;
+        vector<Bool> regs;
+
+        inline Context(): row(0) {}
+    };
+
+private:
+
+    vector<Param> params;
+    std::unordered_map<HashCode, ParamId> param_ids;
+    // String literals of every rule, coded anew so rows are coded once
+    Strings strings;
+    vector<Pred> preds;
+    std::map<std::tuple<ParamId, uint8_t, uint32_t>, PredId> pred_ids;
+    vector<Rule> rules;
+    // Rules without a Need that match rows carrying none of their parameters
+    vector<RuleId> fallbacks;
+    // Parameters with watchers
+    vector<ParamId> watched;
+    bool sorted;
+    // Most slots and registers of a rule
+    size_t width;
+    size_t registers;
+
+    // Context of Match without one
+    Context context;
+
+    inline ParamId Intern(const HashCode &name) {
+        auto it = param_ids.find(name);
+        if (it != param_ids.end())
+            return it->second;
+        ParamId id = (ParamId)params.size();
+        param_ids.emplace(name, id);
+        params.emplace_back(name);
+        return id;
+    }
+
+    inline PredId Intern(const ParamId &param, const Instruction &ins) {
+        uint32_t bits;
+        memcpy(&bits, &ins.val_int, sizeof(bits));
+        auto key = std::make_tuple(param, ins.code, bits);
+        auto it = pred_ids.find(key);
+        if (it != pred_ids.end())
+            return it->second;
+
+        PredId id = (PredId)preds.size();
+        pred_ids.emplace(key, id);
+        preds.push_back(Pred{param, ins.Op(), {}});
+
+        Param &p = params[param];
+        CmpOp op = ins.Op();
+        if (ins.code < Instruction::CmpFloat) {
+            p.ints.Add(op, ins.val_int, id);
+            p.numbers.Add(op, (PropValFloat)ins.val_int, id);
+        } else if (ins.code < Instruction::CmpString) {
+            p.floats.Add(op, ins.val_float, id);
+            p.numbers.Add(op, ins.val_float, id);
+        } else {
+            p.strings.Add(op, ins.val_string, id);
+        }
+        sorted = false;
+        return id;
+    }
+
+    inline void Bind(const HashCode &name, const Slot &value, Context &ctx) const {
+        auto it = param_ids.find(name);
+        if (it == param_ids.end() || ctx.seen[it->second] == ctx.row)
+            return;
+        ctx.seen[it->second] = ctx.row;
+        ctx.values[it->second] = value;
+        ctx.present.push_back(it->second);
+    }
+
+    inline bool Eval(const Rule &rule, Context &ctx) const {
+        size_t n = rule.preds.size();
+        for (size_t i = 0; i < n; ++i) {
+            PredId pred = rule.preds[i];
+            if (ctx.seen[preds[pred].param] != ctx.row)
+                ctx.slots[i].Clear();
+            else
+                ctx.slots[i].Assign((PropValInt)(ctx.satisfied[pred] == ctx.row));
+        }
+        for (size_t i = 0; i < rule.params.size(); ++i) {
+            ParamId param = rule.params[i];
+            if (ctx.seen[param] != ctx.row)
+                ctx.slots[n + i].Clear();
+            else
+                ctx.slots[n + i] = ctx.values[param];
+        }
+        return rule.program.Run(ctx.slots.data(), ctx.regs.data()).ans != Expression::False;
+    }
+
+    // Selectivity of a Need, lower is better: an '=' of a row holds for one
+    // constant, the other operators for many
+    inline size_t Weight(const Rule &rule, const Need &need) const {
+        size_t weight = 0;
+        for (const uint16_t &slot: need.slots)
+            weight += preds[rule.preds[slot]].op == Expression::Eq ? 1 : 8;
+        return weight;
+    }
+
+    inline const Need & Cheaper(const Rule &rule, const Need &need, const Need &other) const {
+        if (need.any)
+            return other;
+        if (other.any)
+            return need;
+        return Weight(rule, other) < Weight(rule, need) ? other : need;
+    }
+
+    inline static void Union(Need &need, const Need &other) {
+        if (need.any || other.any) {
+            need.any = true;
+            need.slots.clear();
+        } else {
+            need.slots.insert(need.slots.end(), other.slots.begin(), other.slots.end());
+        }
+    }
+
+    // A jump, with the Need of its register and of the path it comes from
+    struct Jump {
+        uint16_t reg;
+        Need value;
+        Need path;
+    };
+
+    // The Need of a rewritten rule, by running its program over Needs in
+    // place of Bools: a predicate compare needs itself, False needs nothing
+    // as it never matches, and True, Undefined and other compares need any.
+    // An '&' is not False only if neither operand is, so it needs either
+    // operand's set, an '|' the union of both. Reaching a point needs what
+    // each JumpFalse passed on the way needed too; that is how an '&' of
+    // Definite operands, overwriting one register, keeps its cheapest one.
+    // Jumps carry their register to the target, where only that register is
+    // live (see Program::EmitNode).
+    Need Needs(const Rule &rule) const {
+        const vector<Instruction> &code = rule.program.code;
+        vector<Need> regs(rule.program.registers, Need{true, {}});
+        Need path{true, {}};
+        vector<vector<Jump>> jumps(code.size() + 1);
+        for (size_t i = 0; i <= code.size(); ++i) {
+            for (const Jump &jump: jumps[i])
+                regs[jump.reg] = Cheaper(rule, regs[jump.reg], path);
+            for (const Jump &jump: jumps[i]) {
+                Union(regs[jump.reg], jump.value);
+                Union(path, jump.path);
+            }
+            jumps[i].clear();
+            if (i == code.size())
+                break;
+            const Instruction &ins = code[i];
+            Need &r = regs[ins.dst];
+            if (ins.code < Instruction::CmpParam) {
+                r = Need{false, {ins.a}};
+            } else if (ins.code == Instruction::Load) {
+                r = Need{ins.val_bool != Expression::False, {}};
+            } else if (ins.code == Instruction::And) {
+                r = Need(Cheaper(rule, r, regs[ins.a]));
+            } else if (ins.code == Instruction::Or) {
+                Union(r, regs[ins.a]);
+            } else if (ins.code == Instruction::JumpFalse) {
+                // Taken when False, which needs nothing
+                jumps[ins.target].push_back(Jump{ins.dst, Need{false, {}}, path});
+                path = Need(Cheaper(rule, path, r));
+            } else if (ins.code == Instruction::JumpTrue) {
+                jumps[ins.target].push_back(Jump{ins.dst, Cheaper(rule, r, path), path});
+            } else {
+                r = Need{true, {}};
+            }
+        }
+        Need need = Cheaper(rule, regs[0], path);
+        std::sort(need.slots.begin(), need.slots.end());
+        need.slots.erase(std::unique(need.slots.begin(), need.slots.end()), need.slots.end());
+        return need;
+    }
+
+    // Grows ctx for what was added since it last matched
+    inline void Fit(Context &ctx) const {
+        if (ctx.seen.size() < params.size()) {
+            ctx.seen.resize(params.size(), 0);
+            ctx.values.resize(params.size());
+        }
+        if (ctx.satisfied.size() < preds.size())
+            ctx.satisfied.resize(preds.size(), 0);
+        if (ctx.touched_at.size() < rules.size())
+            ctx.touched_at.resize(rules.size(), 0);
+        if (ctx.slots.size() < width)
+            ctx.slots.resize(width);
+        if (ctx.regs.size() < registers)
+            ctx.regs.resize(registers, Bool(Expression::Undefined));
+    }
+
+public:
+    inline RuleSet(): sorted(true), width(0), registers(0) {}
+
+    // Sorts the indexes of the rules added so far. Match sorts by itself; a
+    // RuleSet shared across threads must be sorted before.
+    inline void Sort() {
+        if (sorted)
+            return;
+        for (Param &p: params)
+            p.Sort();
+        sorted = true;
+    }
+
+    inline size_t Size() const {
+        return rules.size();
+    }
+    // Distinct predicates over all rules
+    inline size_t Predicates() const {
+        return preds.size();
+    }
+
+    RuleId Add(const Expressions &exp) {
+        RuleId id = (RuleId)rules.size();
+        rules.emplace_back();
+        Rule &rule = rules.back();
+        // Bounds stay single predicates the index can serve
+        rule.program.Compile(exp, false);
+
+        vector<ParamId> globals;
+        for (const HashCode &name: rule.program.params)
+            globals.push_back(Intern(name));
+
+        // Predicate slots first, parameter slots after them
+        vector<std::pair<PredId, uint16_t>> pred_slots;
+        vector<std::pair<ParamId, uint16_t>> param_slots;
+        auto pred_slot = [&](const PredId &pred) {
+            for (auto &p: pred_slots)
+                if (p.first == pred)
+                    return p.second;
+            pred_slots.emplace_back(pred, (uint16_t)pred_slots.size());
+            rule.preds.push_back(pred);
+            return pred_slots.back().second;
+        };
+        auto param_slot = [&](const ParamId &param) {
+            for (auto &p: param_slots)
+                if (p.first == param)
+                    return p.second;
+            param_slots.emplace_back(param, (uint16_t)param_slots.size());
+            rule.params.push_back(param);
+            return param_slots.back().second;
+        };
+
+        vector<std::pair<size_t, uint16_t>> param_refs;
+        for (size_t i = 0; i < rule.program.code.size(); ++i) {
+            Instruction &ins = rule.program.code[i];
+            if (ins.code >= Instruction::CmpString && ins.code < Instruction::CmpParam) {
+                const std::string *bytes = exp.Literals().Bytes(ins.val_string);
+                assert(bytes != nullptr);
+                ins.val_string = strings.Intern(bytes->data(), bytes->size());
+            }
+            if (ins.code < Instruction::CmpParam) {
+                uint16_t slot = pred_slot(Intern(globals[ins.a], ins));
+                ins = Instruction(Instruction::CmpInt + Expression::Eq, ins.dst, slot);
+                ins.val_int = 1;
+            } else if (ins.code < Instruction::CmpBool) {
+                param_refs.emplace_back(i, param_slot(globals[ins.a]));
+                param_refs.emplace_back(i, param_slot(globals[ins.b]));
+            }
+        }
+        // Parameter slots live after the predicate slots, known only now
+        for (size_t i = 0; i < param_refs.size(); i += 2) {
+            Instruction &ins = rule.program.code[param_refs[i].first];
+            ins.a = (uint16_t)(rule.preds.size() + param_refs[i].second);
+            ins.b = (uint16_t)(rule.preds.size() + param_refs[i + 1].second);
+        }
+
+        size_t n = rule.preds.size() + rule.params.size();
+        width = std::max(width, n);
+        registers = std::max(registers, rule.program.registers);
+
+        Need need = Needs(rule);
+        if (!need.any) {
+            rule.fallback = false;
+            for (const uint16_t &slot: need.slots) {
+                Pred &pred = preds[rule.preds[slot]];
+                pred.rules.push_back(id);
+                vector<RuleId> &watchers = params[pred.param].watchers;
+                if (watchers.empty())
+                    watched.push_back(pred.param);
+                if (watchers.empty() || watchers.back() != id)
+                    watchers.push_back(id);
+            }
+            return id;
+        }
+
+        std::sort(globals.begin(), globals.end());
+        globals.erase(std::unique(globals.begin(), globals.end()), globals.end());
+        for (const ParamId &param: globals)
+            params[param].rules.push_back(id);
+
+        vector<Slot> slots(n);
+        vector<Bool> regs(rule.program.registers, Bool(Expression::Undefined));
+        rule.fallback = rule.program.Run(slots.data(), regs.data()).ans != Expression::False;
+        if (rule.fallback)
+            fallbacks.push_back(id);
+        return id;
+    }
+
+    inline RuleId Add(const char *in) {
+        Expressions exp;
+        exp.Parse(in);
+        return Add(exp);
+    }
+
+    // Appends the ids of every matching rule to out, in no particular order
+    template <typename iterable>
+    void Match(const iterable& props, vector<RuleId> &out) {
+        Sort();
+        Match(props, out, context);
+    }
+
+    // Thread-safe Match on a sorted RuleSet, see Context
+    template <typename iterable>
+    void Match(const iterable& props, vector<RuleId> &out, Context &ctx) const {
+        assert(sorted);
+        Fit(ctx);
+        if (++ctx.row == 0) {
+            std::fill(ctx.seen.begin(), ctx.seen.end(), 0);
+            std::fill(ctx.satisfied.begin(), ctx.satisfied.end(), 0);
+            std::fill(ctx.touched_at.begin(), ctx.touched_at.end(), 0);
+            ctx.row = 1;
+        }
+        ctx.present.clear();
+        ctx.touched.clear();
+
+        Slot value;
+        int tot = props.size();
+        for (auto it = props.begin(); tot > 0; ++it, --tot) {
+            auto type = it->Type();
+            if (type == Expression::PropString)
+                Bind(Hash(it->Name(), it->NameLen()), value.Assign(strings.Code(it->String(), it->ValLen())), ctx);
+            else if (type == Expression::PropInt)
+                Bind(Hash(it->Name(), it->NameLen()), value.Assign(it->Int()), ctx);
+            else if (type == Expression::PropFloat)
+                Bind(Hash(it->Name(), it->NameLen()), value.Assign(it->Float()), ctx);
+        }
+
+        uint32_t stamp = ctx.row;
+        auto touch = [&](const RuleId &rule) {
+            if (ctx.touched_at[rule] != stamp) {
+                ctx.touched_at[rule] = stamp;
+                ctx.touched.push_back(rule);
+            }
+        };
+        auto satisfy = [&](const PredId &pred) {
+            ctx.satisfied[pred] = stamp;
+            for (const RuleId &rule: preds[pred].rules)
+                touch(rule);
+        };
+        for (const ParamId &id: ctx.present) {
+            const Param &param = params[id];
+            const Slot &val = ctx.values[id];
+            if (val.type == Expression::PropInt) {
+                param.ints.Scan(val.val_int, satisfy);
+                param.floats.Scan((PropValFloat)val.val_int, satisfy);
+            } else if (val.type == Expression::PropFloat) {
+                param.numbers.Scan(val.val_float, satisfy);
+            } else {
+                param.strings.Scan(val.val_string, satisfy);
+            }
+            for (const RuleId &rule: param.rules)
+                touch(rule);
+        }
+        for (const ParamId &id: watched)
+            if (ctx.seen[id] != stamp)
+                for (const RuleId &rule: params[id].watchers)
+                    touch(rule);
+
+        for (const RuleId &rule: ctx.touched)
+            if (Eval(rules[rule], ctx))
+                out.push_back(rule);
+        for (const RuleId &rule: fallbacks)
+            if (ctx.touched_at[rule] != ctx.row)
+                out.push_back(rule);
+    }
+};
@@ -0,0 +1,150 @@
+#pragma once
+
+#include "rapidjson/reader.h"
+#include "expression.h"
+
+// Matches one JSON object straight off rapidjson::Reader, without building a
+// Document. Keys are hashed as they stream past and only the values of
+// parameters the expression references are hashed and bound; nested objects
+// and arrays are skipped. Parsing stops as soon as every referenced parameter
+// is bound, or earlier once the values bound so far decide it whatever the
+// others are (see Expressions::Decided), since the rest of the row cannot
+// change the verdict.
+//
+// A SaxMatcher keeps the row in a Context of its own, so threads can share
+// one Expressions with a matcher each.
+//
+// Usage:
+//     SaxMatcher matcher(exp);
+//     bool matched = matcher.Match(R"({"brand": "Apple", "price": 5888.8})");
+class SaxMatcher : public rapidjson::BaseReaderHandler<rapidjson::UTF8<>, SaxMatcher> {
+    const Expressions &exp;
+    Expressions::Context context;
+    rapidjson::Reader reader;
+
+    int depth;
+    int slot;
+    size_t pending;
+    bool done;
+    bool verdict;
+
+    inline bool Value() {
+        slot = -1;
+        if (depth == 1 && pending == 0)
+            return Finish();
+        return true;
+    }
+
+    template <typename T>
+    inline bool Value(const T &val) {
+        if (depth == 1 && slot >= 0) {
+            Slot &bound = context.slots[slot];
+            if (bound.type == Expression::PropNone) {
+                bound.Assign(val);
+                if (--pending > 0 && context.stats == nullptr && exp.Decided(context, slot, verdict)) {
+                    done = true;
+                    return false;
+                }
+            }
+        }
+        return Value();
+    }
+
+    inline bool Finish() {
+        verdict = exp.Eval(context);
+        done = true;
+        return false;
+    }
+
+public:
+    inline explicit SaxMatcher(const Expressions &exp_) :
+        exp(exp_), depth(0), slot(-1), pending(0), done(false), verdict(false) {}
+
+    // Parses one JSON object from a rapidjson input stream and tells whether
+    // it matches. Malformed input or a non-object row never matches.
+    template <typename InputStream>
+    inline bool Match(InputStream &is) {
+        depth = 0;
+        slot = -1;
+        done = false;
+        verdict = false;
+        reader.Parse<rapidjson::kParseStopWhenDoneFlag>(is, *this);
+        return done && verdict;
+    }
+
+    inline bool Match(const char *json) {
+        rapidjson::StringStream is(json);
+        return Match(is);
+    }
+
+    // Row state, e.g. to attach PredicateCounters to. Counting reads every
+    // row to the end, so the predicates are counted as Eval runs them.
+    inline Expressions::Context & State() {
+        return context;
+    }
+
+    inline rapidjson::ParseErrorCode Error() const {
+        return done ? rapidjson::kParseErrorNone : reader.GetParseErrorCode();
+    }
+
+    inline bool Default() {
+        return Value();
+    }
+    // Integers bind as ints where they fit one and as floats beyond, as Dict
+    // in main.cpp reads them
+    inline bool Int(int i) {
+        return Value((Expression::PropValInt)i);
+    }
+    inline bool Uint(unsigned u) {
+        if (u > 0x7FFFFFFFU)
+            return Value((Expression::PropValFloat)u);
+        return Value((Expression::PropValInt)u);
+    }
+    inline bool Int64(int64_t i) {
+        if (i >= INT32_MIN && i <= INT32_MAX)
+            return Value((Expression::PropValInt)i);
+        return Value((Expression::PropValFloat)i);
+    }
+    inline bool Uint64(uint64_t u) {
+        if (u <= 0x7FFFFFFFU)
+            return Value((Expression::PropValInt)u);
+        return Value((Expression::PropValFloat)u);
+    }
+    inline bool Double(double d) {
+        return Value((Expression::PropValFloat)d);
+    }
+    inline bool String(const char *str, rapidjson::SizeType len, bool) {
+        if (depth == 1 && slot >= 0)
+            return Value(exp.Code(str, len));
+        return Value();
+    }
+    inline bool Key(const char *str, rapidjson::SizeType len, bool) {
+        if (depth == 1)
+            slot = exp.Find(str, len);
+        return true;
+    }
+    inline bool StartObject() {
+        if (depth++ == 0) {
+            exp.Reset(context);
+            pending = exp.Params();
+            if (pending == 0)
+                return Finish();
+        }
+        return true;
+    }
+    inline bool EndObject(rapidjson::SizeType) {
+        if (--depth == 0)
+            return Finish();
+        return Value();
+    }
+    inline bool StartArray() {
+        if (depth == 0)
+            return false;
+        ++depth;
+        return true;
+    }
+    inline bool EndArray(rapidjson::SizeType) {
+        --depth;
+        return Value();
+    }
+};
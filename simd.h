@@ -0,0 +1,386 @@
+#pragma once
+
+#include <algorithm>
+#include <functional>
+
+#include "expression.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define EXPRESSION_X86 1
+#include <immintrin.h>
+#endif
+
+// Bitmap kernels for BatchMatcher: compare a column with a constant or with
+// another column, writing bit i of out[i / 64] for row i, and combine masks.
+//
+// The AVX2 kernels carry a target attribute, so the build needs no -mavx2.
+// Every kernel takes the level to run at, Detect being the CPU's (AVX2, else
+// SSE2, else the scalar loops); there is no global level, so matchers on
+// other threads can run at their own, e.g. to compare results.
+class Simd {
+    using CmpOp = Expression::CmpOp;
+
+    using PropValInt = Expression::PropValInt;
+    using PropValFloat = Expression::PropValFloat;
+
+public:
+    enum Isa {
+        Scalar,
+        Sse2,
+        Avx2,
+    };
+
+    inline static Isa Detect() {
+        static const Isa best = Probe();
+        return best;
+    }
+
+private:
+    inline static Isa Probe() {
+#ifdef EXPRESSION_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            return Avx2;
+        return Sse2;
+#else
+        return Scalar;
+#endif
+    }
+
+    template <int op, typename U, typename A, typename B>
+    inline static void Loop(const A &a, const B &b, const size_t &begin, const size_t &rows, uint64_t *out) {
+        for (size_t i = begin; i < rows; i += 64) {
+            size_t n = std::min(rows - i, (size_t)64);
+            uint64_t bits = 0;
+            for (size_t j = 0; j < n; ++j)
+                bits |= (uint64_t)Cmp<op, U>(a[i + j], b[i + j]) << j;
+            out[i / 64] = bits;
+        }
+    }
+
+    template <int op, typename U>
+    inline static bool Cmp(const U &a, const U &b) {
+        switch (op) {
+            case Expression::Eq:
+                return a == b;
+            case Expression::Ge:
+                return b <= a;
+            case Expression::Le:
+                return a <= b;
+            case Expression::Gt:
+                return b < a;
+            default:
+                return a < b;
+        }
+    }
+
+    // Reads a column or repeats a constant, converted to the compare type U
+    template <typename U, typename T>
+    struct Array {
+        const T *p;
+        inline U operator [] (const size_t &i) const {
+            return (U)p[i];
+        }
+    };
+    template <typename U>
+    struct Const {
+        U val;
+        inline U operator [] (const size_t &) const {
+            return val;
+        }
+    };
+
+#ifdef EXPRESSION_X86
+    // Lanes are loaded as the compare type: int32 as is, int32 converted for
+    // float compares, and string hashes with the sign bit flipped so that
+    // signed compares order them as unsigned.
+    struct X86 {
+        __attribute__((target("avx2"))) inline static __m256i Load8(const PropValInt *p, const PropValInt &) {
+            return _mm256_loadu_si256((const __m256i *)p);
+        }
+        __attribute__((target("avx2"))) inline static __m256 Load8(const PropValInt *p, const PropValFloat &) {
+            return _mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i *)p));
+        }
+        __attribute__((target("avx2"))) inline static __m256 Load8(const PropValFloat *p, const PropValFloat &) {
+            return _mm256_loadu_ps(p);
+        }
+        __attribute__((target("avx2"))) inline static __m256i Load8(const HashCode *p, const HashCode &) {
+            return _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)p), _mm256_set1_epi32((int)0x80000000U));
+        }
+        __attribute__((target("avx2"))) inline static __m256i Set8(const PropValInt &x) {
+            return _mm256_set1_epi32(x);
+        }
+        __attribute__((target("avx2"))) inline static __m256 Set8(const PropValFloat &x) {
+            return _mm256_set1_ps(x);
+        }
+        __attribute__((target("avx2"))) inline static __m256i Set8(const HashCode &x) {
+            return _mm256_set1_epi32((int)(x ^ 0x80000000U));
+        }
+        template <int op>
+        __attribute__((target("avx2"))) inline static uint32_t Mask8(const __m256i &a, const __m256i &b) {
+            switch (op) {
+                case Expression::Eq:
+                    return (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(a, b)));
+                case Expression::Ge:
+                    return ~(uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(b, a))) & 0xFF;
+                case Expression::Le:
+                    return ~(uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(a, b))) & 0xFF;
+                case Expression::Gt:
+                    return (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(a, b)));
+                default:
+                    return (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(b, a)));
+            }
+        }
+        template <int op>
+        __attribute__((target("avx2"))) inline static uint32_t Mask8(const __m256 &a, const __m256 &b) {
+            switch (op) {
+                case Expression::Eq:
+                    return (uint32_t)_mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_EQ_OQ));
+                case Expression::Ge:
+                    return (uint32_t)_mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_GE_OQ));
+                case Expression::Le:
+                    return (uint32_t)_mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_LE_OQ));
+                case Expression::Gt:
+                    return (uint32_t)_mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_GT_OQ));
+                default:
+                    return (uint32_t)_mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_LT_OQ));
+            }
+        }
+
+        inline static __m128i Load4(const PropValInt *p, const PropValInt &) {
+            return _mm_loadu_si128((const __m128i *)p);
+        }
+        inline static __m128 Load4(const PropValInt *p, const PropValFloat &) {
+            return _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *)p));
+        }
+        inline static __m128 Load4(const PropValFloat *p, const PropValFloat &) {
+            return _mm_loadu_ps(p);
+        }
+        inline static __m128i Load4(const HashCode *p, const HashCode &) {
+            return _mm_xor_si128(_mm_loadu_si128((const __m128i *)p), _mm_set1_epi32((int)0x80000000U));
+        }
+        inline static __m128i Set4(const PropValInt &x) {
+            return _mm_set1_epi32(x);
+        }
+        inline static __m128 Set4(const PropValFloat &x) {
+            return _mm_set1_ps(x);
+        }
+        inline static __m128i Set4(const HashCode &x) {
+            return _mm_set1_epi32((int)(x ^ 0x80000000U));
+        }
+        template <int op>
+        inline static uint32_t Mask4(const __m128i &a, const __m128i &b) {
+            switch (op) {
+                case Expression::Eq:
+                    return (uint32_t)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(a, b)));
+                case Expression::Ge:
+                    return ~(uint32_t)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmplt_epi32(a, b))) & 0xF;
+                case Expression::Le:
+                    return ~(uint32_t)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(a, b))) & 0xF;
+                case Expression::Gt:
+                    return (uint32_t)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(a, b)));
+                default:
+                    return (uint32_t)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmplt_epi32(a, b)));
+            }
+        }
+        template <int op>
+        inline static uint32_t Mask4(const __m128 &a, const __m128 &b) {
+            switch (op) {
+                case Expression::Eq:
+                    return (uint32_t)_mm_movemask_ps(_mm_cmpeq_ps(a, b));
+                case Expression::Ge:
+                    return (uint32_t)_mm_movemask_ps(_mm_cmpge_ps(a, b));
+                case Expression::Le:
+                    return (uint32_t)_mm_movemask_ps(_mm_cmple_ps(a, b));
+                case Expression::Gt:
+                    return (uint32_t)_mm_movemask_ps(_mm_cmpgt_ps(a, b));
+                default:
+                    return (uint32_t)_mm_movemask_ps(_mm_cmplt_ps(a, b));
+            }
+        }
+
+        // Whole 64-row words only; the caller finishes the tail
+        template <int op, typename U, typename T>
+        __attribute__((target("avx2"))) static void Avx2(const T *a, const U &b, const size_t &words, uint64_t *out) {
+            auto vb = Set8(b);
+            for (size_t w = 0; w < words; ++w, a += 64) {
+                uint64_t bits = 0;
+                for (int k = 0; k < 8; ++k)
+                    bits |= (uint64_t)Mask8<op>(Load8(a + k * 8, b), vb) << (k * 8);
+                out[w] = bits;
+            }
+        }
+        template <int op, typename U, typename T, typename V>
+        __attribute__((target("avx2"))) static void Avx2(const T *a, const V *b, const size_t &words, uint64_t *out) {
+            for (size_t w = 0; w < words; ++w, a += 64, b += 64) {
+                uint64_t bits = 0;
+                for (int k = 0; k < 8; ++k)
+                    bits |= (uint64_t)Mask8<op>(Load8(a + k * 8, U()), Load8(b + k * 8, U())) << (k * 8);
+                out[w] = bits;
+            }
+        }
+        template <int op, typename U, typename T>
+        static void Sse2(const T *a, const U &b, const size_t &words, uint64_t *out) {
+            auto vb = Set4(b);
+            for (size_t w = 0; w < words; ++w, a += 64) {
+                uint64_t bits = 0;
+                for (int k = 0; k < 16; ++k)
+                    bits |= (uint64_t)Mask4<op>(Load4(a + k * 4, b), vb) << (k * 4);
+                out[w] = bits;
+            }
+        }
+        template <int op, typename U, typename T, typename V>
+        static void Sse2(const T *a, const V *b, const size_t &words, uint64_t *out) {
+            for (size_t w = 0; w < words; ++w, a += 64, b += 64) {
+                uint64_t bits = 0;
+                for (int k = 0; k < 16; ++k)
+                    bits |= (uint64_t)Mask4<op>(Load4(a + k * 4, U()), Load4(b + k * 4, U())) << (k * 4);
+                out[w] = bits;
+            }
+        }
+
+        __attribute__((target("avx2"))) static void Avx2Or(uint64_t *out, const uint64_t *a, const size_t &words) {
+            size_t w = 0;
+            for (; w + 4 <= words; w += 4) {
+                __m256i x = _mm256_loadu_si256((const __m256i *)(out + w));
+                __m256i y = _mm256_loadu_si256((const __m256i *)(a + w));
+                _mm256_storeu_si256((__m256i *)(out + w), _mm256_or_si256(x, y));
+            }
+            for (; w < words; ++w)
+                out[w] |= a[w];
+        }
+        __attribute__((target("avx2"))) static void Avx2Blend(uint64_t *out, const uint64_t *bits, const uint64_t *mask, const size_t &words) {
+            size_t w = 0;
+            for (; w + 4 <= words; w += 4) {
+                __m256i x = _mm256_loadu_si256((const __m256i *)(out + w));
+                __m256i y = _mm256_loadu_si256((const __m256i *)(bits + w));
+                __m256i m = _mm256_loadu_si256((const __m256i *)(mask + w));
+                _mm256_storeu_si256((__m256i *)(out + w), _mm256_or_si256(_mm256_andnot_si256(m, x), _mm256_and_si256(y, m)));
+            }
+            for (; w < words; ++w)
+                out[w] = (out[w] & ~mask[w]) | (bits[w] & mask[w]);
+        }
+        __attribute__((target("avx2"))) static void Avx2And(uint64_t *out, const uint64_t *a, const size_t &words) {
+            size_t w = 0;
+            for (; w + 4 <= words; w += 4) {
+                __m256i x = _mm256_loadu_si256((const __m256i *)(out + w));
+                __m256i y = _mm256_loadu_si256((const __m256i *)(a + w));
+                _mm256_storeu_si256((__m256i *)(out + w), _mm256_and_si256(x, y));
+            }
+            for (; w < words; ++w)
+                out[w] &= a[w];
+        }
+        __attribute__((target("avx2"))) static void Avx2AndNot(uint64_t *out, const uint64_t *a, const size_t &words) {
+            size_t w = 0;
+            for (; w + 4 <= words; w += 4) {
+                __m256i x = _mm256_loadu_si256((const __m256i *)(out + w));
+                __m256i y = _mm256_loadu_si256((const __m256i *)(a + w));
+                _mm256_storeu_si256((__m256i *)(out + w), _mm256_andnot_si256(y, x));
+            }
+            for (; w < words; ++w)
+                out[w] &= ~a[w];
+        }
+    };
+
+    template <int op, typename U, typename T>
+    inline static size_t Vector(const Isa &isa, const T *a, const U &b, const size_t &rows, uint64_t *out) {
+        size_t words = rows / 64;
+        if (isa == Avx2)
+            X86::Avx2<op, U>(a, b, words, out);
+        else if (isa == Sse2)
+            X86::Sse2<op, U>(a, b, words, out);
+        else
+            return 0;
+        return words * 64;
+    }
+    template <int op, typename U, typename T, typename V>
+    inline static size_t Vector(const Isa &isa, const T *a, const V *b, const size_t &rows, uint64_t *out) {
+        size_t words = rows / 64;
+        if (isa == Avx2)
+            X86::Avx2<op, U>(a, b, words, out);
+        else if (isa == Sse2)
+            X86::Sse2<op, U>(a, b, words, out);
+        else
+            return 0;
+        return words * 64;
+    }
+#else
+    template <int op, typename U, typename T, typename B>
+    inline static size_t Vector(const Isa &, const T *, const B &, const size_t &, uint64_t *) {
+        return 0;
+    }
+#endif
+
+    template <int op, typename U, typename T>
+    inline static void Kernel(const Isa &isa, const T *a, const U &b, const size_t &rows, uint64_t *out) {
+        size_t done = Vector<op, U>(isa, a, b, rows, out);
+        Loop<op, U>(Array<U, T>{a}, Const<U>{b}, done, rows, out);
+    }
+    template <int op, typename U, typename T, typename V>
+    inline static void Kernel(const Isa &isa, const T *a, const V *b, const size_t &rows, uint64_t *out) {
+        size_t done = Vector<op, U>(isa, a, b, rows, out);
+        Loop<op, U>(Array<U, T>{a}, Array<U, V>{b}, done, rows, out);
+    }
+
+public:
+    // out[row] = a[row] <op> b, compared as U, for a constant or a column b
+    template <typename U, typename T, typename B>
+    inline static void Compare(const Isa &isa, const T *a, const CmpOp &op, const B &b, const size_t &rows,
+                               uint64_t *out) {
+        switch (op) {
+            case Expression::Eq:
+                return Kernel<Expression::Eq, U>(isa, a, b, rows, out);
+            case Expression::Ge:
+                return Kernel<Expression::Ge, U>(isa, a, b, rows, out);
+            case Expression::Le:
+                return Kernel<Expression::Le, U>(isa, a, b, rows, out);
+            case Expression::Gt:
+                return Kernel<Expression::Gt, U>(isa, a, b, rows, out);
+            case Expression::Lt:
+                return Kernel<Expression::Lt, U>(isa, a, b, rows, out);
+            default:
+                assert(false);
+        }
+    }
+
+    // out |= a
+    inline static void Or(const Isa &isa, uint64_t *out, const uint64_t *a, const size_t &words) {
+#ifdef EXPRESSION_X86
+        if (isa == Avx2)
+            return X86::Avx2Or(out, a, words);
+#endif
+        for (size_t w = 0; w < words; ++w)
+            out[w] |= a[w];
+    }
+
+    // out = bits where mask is set, out elsewhere
+    inline static void Blend(const Isa &isa, uint64_t *out, const uint64_t *bits, const uint64_t *mask,
+                             const size_t &words) {
+#ifdef EXPRESSION_X86
+        if (isa == Avx2)
+            return X86::Avx2Blend(out, bits, mask, words);
+#endif
+        for (size_t w = 0; w < words; ++w)
+            out[w] = (out[w] & ~mask[w]) | (bits[w] & mask[w]);
+    }
+
+    // out &= a
+    inline static void And(const Isa &isa, uint64_t *out, const uint64_t *a, const size_t &words) {
+#ifdef EXPRESSION_X86
+        if (isa == Avx2)
+            return X86::Avx2And(out, a, words);
+#endif
+        for (size_t w = 0; w < words; ++w)
+            out[w] &= a[w];
+    }
+
+    // out &= ~a
+    inline static void AndNot(const Isa &isa, uint64_t *out, const uint64_t *a, const size_t &words) {
+#ifdef EXPRESSION_X86
+        if (isa == Avx2)
+            return X86::Avx2AndNot(out, a, words);
+#endif
+        for (size_t w = 0; w < words; ++w)
+            out[w] &= ~a[w];
+    }
+};
@@ -0,0 +1,425 @@
+#pragma once
+
+#include <type_traits>
+
+#include "expression.h"
+
+// Expressions parsed by the compiler: the text of a rule becomes a tree of
+// types, and Match is plain inlined code with no parsing, slot table or
+// instruction dispatch left at run time.
+//
+// Grammar and results are those of Expressions::Parse and Match: '&' and '|'
+// bind loosest and alike, left to right; comparisons on a missing parameter
+// are True, strings compared with numbers are False, ints compare as floats
+// against floats and bare values are Undefined as Bools. Parameter names and
+// string literals are compared by their bytes, so nothing depends on Hash
+// except '<' and '>' on strings, which order hashes as Program does.
+//
+// Texts are parsed by C++11 constexpr recursion, one level per byte, so they
+// are bound by the compiler's constexpr depth (512 by default).
+//
+// Usage:
+//     STATIC_EXPRESSION(Premium, "brand = 'Apple' & price > 6000");
+//     bool matched = Premium::Match(row);
+#define STATIC_EXPRESSION(name, text)                                   \
+    struct name##Text {                                                 \
+        static constexpr const char * Str() {                          \
+            return text;                                                \
+        }                                                               \
+    };                                                                  \
+    using name = StaticExpression<name##Text>
+
+// A value bound from a row or given by a literal. Strings keep their bytes.
+struct StaticSlot {
+    Expression::PropType type;
+    Expression::PropValInt val_int;
+    Expression::PropValFloat val_float;
+    const char *str;
+    size_t len;
+
+    inline Expression::PropValFloat Float() const {
+        return type == Expression::PropInt ? (Expression::PropValFloat)val_int : val_float;
+    }
+
+    template <typename T>
+    inline static bool Cmp(const T &a, const Expression::CmpOp &op, const T &b) {
+        switch (op) {
+            case Expression::Eq:
+                return a == b;
+            case Expression::Ge:
+                return b <= a;
+            case Expression::Le:
+                return a <= b;
+            case Expression::Gt:
+                return b < a;
+            case Expression::Lt:
+                return a < b;
+            default:
+                assert(false);
+        }
+        return false;
+    }
+
+    // As Program::Compare
+    inline static Expression::Bool Compare(const StaticSlot &a, const Expression::CmpOp &op, const StaticSlot &b) {
+        using Bool = Expression::Bool;
+        if (a.type == Expression::PropNone || b.type == Expression::PropNone)
+            return Bool(true);
+        if (a.type == Expression::PropString || b.type == Expression::PropString) {
+            if (a.type != b.type)
+                return Bool(false);
+            if (op == Expression::Eq)
+                return Bool(a.len == b.len && memcmp(a.str, b.str, a.len) == 0);
+            return Bool(Cmp(Hash(a.str, a.len), op, Hash(b.str, b.len)));
+        }
+        if (a.type == Expression::PropFloat || b.type == Expression::PropFloat)
+            return Bool(Cmp(a.Float(), op, b.Float()));
+        return Bool(Cmp(a.val_int, op, b.val_int));
+    }
+};
+
+// Scanning of the text, mirroring Expressions::Parse
+struct StaticText {
+    enum Kind {
+        Param,
+        Number,
+        String,
+        Group,
+        Bad,
+    };
+
+    static constexpr bool IsAlpha(const char c) {
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+    }
+    static constexpr bool IsDigit(const char c) {
+        return c >= '0' && c <= '9';
+    }
+    static constexpr bool IsW(const char c) {
+        return IsAlpha(c) || IsDigit(c) || c == '_';
+    }
+    static constexpr bool IsD(const char c) {
+        return IsDigit(c) || c == '.';
+    }
+
+    static constexpr Kind KindOf(const char c) {
+        return IsAlpha(c) ? Param : IsDigit(c) || c == '-' ? Number : c == '\'' ? String : c == '(' ? Group : Bad;
+    }
+
+    // First position from i on that is not a blank
+    static constexpr size_t Skip(const char *s, const size_t i) {
+        return s[i] == ' ' || s[i] == '\t' ? Skip(s, i + 1) : i;
+    }
+    // End of the name starting at i
+    static constexpr size_t Word(const char *s, const size_t i) {
+        return IsW(s[i]) ? Word(s, i + 1) : i;
+    }
+    // End of the digits and dots starting at i
+    static constexpr size_t Digits(const char *s, const size_t i) {
+        return IsD(s[i]) ? Digits(s, i + 1) : i;
+    }
+    // Position of the quote closing a string
+    static constexpr size_t Quote(const char *s, const size_t i) {
+        return s[i] == '\'' ? i : Quote(s, i + 1);
+    }
+    // Position of the first dot in [i, end), end if none
+    static constexpr size_t Dot(const char *s, const size_t i, const size_t end) {
+        return i == end || s[i] == '.' ? i : Dot(s, i + 1, end);
+    }
+    static constexpr size_t Length(const char *s, const size_t i = 0) {
+        return s[i] == 0 ? i : Length(s, i + 1);
+    }
+    // Parameter names starting before end, i.e. the slot of the name at end
+    static constexpr size_t Names(const char *s, const size_t i, const size_t end) {
+        return i >= end ? 0 :
+               s[i] == '\'' ? Names(s, Quote(s, i + 1) + 1, end) :
+               IsAlpha(s[i]) ? 1 + Names(s, Word(s, i), end) :
+               Names(s, i + 1, end);
+    }
+
+    static constexpr Expression::PropValInt Int(const char *s, const size_t i, const size_t end,
+                                                const Expression::PropValInt ans) {
+        return i == end ? ans : Int(s, i + 1, end, ans * 10 + s[i] - 48);
+    }
+    // The digits after the dot and their scale, step by step as Parse
+    // accumulates them so both round alike
+    static constexpr Expression::PropValFloat Fraction(const char *s, const size_t i, const size_t end,
+                                                       const Expression::PropValFloat ans) {
+        return i == end ? ans : Fraction(s, i + 1, end, ans * 10 + (s[i] - 48));
+    }
+    static constexpr float Scale(const size_t i, const size_t end, const float d) {
+        return i == end ? d : Scale(i + 1, end, (float)(d * 0.1));
+    }
+
+    static constexpr Expression::CmpOp Op(const char c, const bool with_eq) {
+        return c == '=' ? Expression::Eq :
+               c == '>' ? (with_eq ? Expression::Ge : Expression::Gt) :
+               (with_eq ? Expression::Le : Expression::Lt);
+    }
+};
+
+template <typename S, size_t Off, size_t Len, size_t Index>
+struct StaticParam {
+    static const bool IsValue = true;
+
+    inline static StaticSlot Value(const StaticSlot *slots) {
+        return slots[Index];
+    }
+    inline static Expression::Bool Eval(const StaticSlot *) {
+        return Expression::Bool(Expression::Undefined);
+    }
+
+    // Binds the property it points at if it is this parameter, first wins.
+    // Returns the number of slots bound.
+    template <typename It>
+    inline static size_t Bind(It &it, const char *name, const size_t &len, StaticSlot *slots) {
+        StaticSlot &slot = slots[Index];
+        if (slot.type != Expression::PropNone || len != Len || memcmp(name, S::Str() + Off, Len) != 0)
+            return 0;
+        slot.type = it->Type();
+        if (slot.type == Expression::PropString) {
+            slot.str = it->String();
+            slot.len = it->ValLen();
+        } else if (slot.type == Expression::PropInt) {
+            slot.val_int = it->Int();
+        } else {
+            slot.val_float = it->Float();
+        }
+        return 1;
+    }
+};
+
+template <typename S, size_t Off, size_t End>
+struct StaticNumber {
+    static const bool IsValue = true;
+
+    static constexpr size_t Start() {
+        return S::Str()[Off] == '-' ? Off + 1 : Off;
+    }
+    static constexpr size_t Dot() {
+        return StaticText::Dot(S::Str(), Start(), End);
+    }
+    // First digit after the dot, End for ints
+    static constexpr size_t Decimals() {
+        return Dot() == End ? End : Dot() + 1;
+    }
+    static constexpr Expression::PropValInt Fac() {
+        return S::Str()[Off] == '-' ? -1 : 1;
+    }
+
+    inline static StaticSlot Value(const StaticSlot *) {
+        StaticSlot slot;
+        constexpr Expression::PropValInt ans = StaticText::Int(S::Str(), Start(), Dot(), 0);
+        if (Dot() == End) {
+            slot.type = Expression::PropInt;
+            slot.val_int = Fac() * ans;
+        } else {
+            constexpr Expression::PropValFloat val = Fac() *
+                StaticText::Fraction(S::Str(), Decimals(), End, (Expression::PropValFloat)ans) *
+                StaticText::Scale(Decimals(), End, 1);
+            slot.type = Expression::PropFloat;
+            slot.val_float = val;
+        }
+        return slot;
+    }
+    inline static Expression::Bool Eval(const StaticSlot *) {
+        return Expression::Bool(Expression::Undefined);
+    }
+    template <typename It>
+    inline static size_t Bind(It &, const char *, const size_t &, StaticSlot *) {
+        return 0;
+    }
+};
+
+template <typename S, size_t Off, size_t Len>
+struct StaticString {
+    static const bool IsValue = true;
+
+    inline static StaticSlot Value(const StaticSlot *) {
+        StaticSlot slot;
+        slot.type = Expression::PropString;
+        slot.str = S::Str() + Off;
+        slot.len = Len;
+        return slot;
+    }
+    inline static Expression::Bool Eval(const StaticSlot *) {
+        return Expression::Bool(Expression::Undefined);
+    }
+    template <typename It>
+    inline static size_t Bind(It &, const char *, const size_t &, StaticSlot *) {
+        return 0;
+    }
+};
+
+template <typename L, Expression::CmpOp Op, typename R>
+struct StaticCompare {
+    static const bool IsValue = false;
+
+    // Two values
+    inline static Expression::Bool Eval(const StaticSlot *slots, std::true_type, std::true_type) {
+        return StaticSlot::Compare(L::Value(slots), Op, R::Value(slots));
+    }
+    // Two Bools
+    inline static Expression::Bool Eval(const StaticSlot *slots, std::false_type, std::false_type) {
+        return Program::Compare(L::Eval(slots), Op, R::Eval(slots));
+    }
+    // A Bool and a value, which is Undefined as a Bool and compares True
+    template <typename A, typename B>
+    inline static Expression::Bool Eval(const StaticSlot *, A, B) {
+        return Expression::Bool(true);
+    }
+
+    inline static Expression::Bool Eval(const StaticSlot *slots) {
+        return Eval(slots, std::integral_constant<bool, L::IsValue>(), std::integral_constant<bool, R::IsValue>());
+    }
+    template <typename It>
+    inline static size_t Bind(It &it, const char *name, const size_t &len, StaticSlot *slots) {
+        return L::Bind(it, name, len, slots) + R::Bind(it, name, len, slots);
+    }
+};
+
+template <typename L, Expression::CmpOp Op, typename R>
+struct StaticLogic {
+    static const bool IsValue = false;
+
+    inline static Expression::Bool Eval(const StaticSlot *slots) {
+        Expression::Bool lhs = L::Eval(slots);
+        if (Op == Expression::And) {
+            if (lhs.ans == Expression::False)
+                return lhs;
+            return lhs && R::Eval(slots);
+        }
+        if (lhs.ans == Expression::True)
+            return lhs;
+        return lhs || R::Eval(slots);
+    }
+    template <typename It>
+    inline static size_t Bind(It &it, const char *name, const size_t &len, StaticSlot *slots) {
+        return L::Bind(it, name, len, slots) + R::Bind(it, name, len, slots);
+    }
+};
+
+// The parser: every level takes the position it starts at and gives the
+// Type it read and the End position after it.
+
+template <typename S, size_t Pos>
+struct StaticParseLogic;
+
+template <typename S, size_t Pos, StaticText::Kind K = StaticText::KindOf(S::Str()[Pos])>
+struct StaticParsePrimary {
+    static_assert(K != StaticText::Bad, "expected a parameter, number, string or '('");
+};
+
+template <typename S, size_t Pos>
+struct StaticParsePrimary<S, Pos, StaticText::Param> {
+    static constexpr size_t End = StaticText::Word(S::Str(), Pos);
+    using Type = StaticParam<S, Pos, End - Pos, StaticText::Names(S::Str(), 0, Pos)>;
+};
+
+template <typename S, size_t Pos>
+struct StaticParsePrimary<S, Pos, StaticText::Number> {
+    static constexpr size_t End = StaticText::Digits(S::Str(), S::Str()[Pos] == '-' ? Pos + 1 : Pos);
+    using Type = StaticNumber<S, Pos, End>;
+};
+
+template <typename S, size_t Pos>
+struct StaticParsePrimary<S, Pos, StaticText::String> {
+    static constexpr size_t End = StaticText::Quote(S::Str(), Pos + 1) + 1;
+    using Type = StaticString<S, Pos + 1, End - Pos - 2>;
+};
+
+template <typename S, size_t Pos>
+struct StaticParsePrimary<S, Pos, StaticText::Group> {
+    using Inner = StaticParseLogic<S, StaticText::Skip(S::Str(), Pos + 1)>;
+    static constexpr size_t Close = StaticText::Skip(S::Str(), Inner::End);
+    static_assert(S::Str()[Close] == ')', "expected ')'");
+    static constexpr size_t End = Close + 1;
+    using Type = typename Inner::Type;
+};
+
+// Comparisons, left to right after the first operand Acc
+template <typename S, typename Acc, size_t Pos, char C = S::Str()[Pos]>
+struct StaticParseCompareTail {
+    static constexpr size_t End = Pos;
+    using Type = Acc;
+};
+
+template <typename S, typename Acc, size_t Pos>
+struct StaticParseCompareStep {
+    static constexpr bool WithEq = S::Str()[Pos + 1] == '=';
+    using Rhs = StaticParsePrimary<S, StaticText::Skip(S::Str(), Pos + 1 + WithEq)>;
+    using Next = StaticParseCompareTail<S, StaticCompare<Acc, StaticText::Op(S::Str()[Pos], WithEq), typename Rhs::Type>,
+                                        StaticText::Skip(S::Str(), Rhs::End)>;
+    static constexpr size_t End = Next::End;
+    using Type = typename Next::Type;
+};
+
+template <typename S, typename Acc, size_t Pos>
+struct StaticParseCompareTail<S, Acc, Pos, '='> : StaticParseCompareStep<S, Acc, Pos> {};
+template <typename S, typename Acc, size_t Pos>
+struct StaticParseCompareTail<S, Acc, Pos, '>'> : StaticParseCompareStep<S, Acc, Pos> {};
+template <typename S, typename Acc, size_t Pos>
+struct StaticParseCompareTail<S, Acc, Pos, '<'> : StaticParseCompareStep<S, Acc, Pos> {};
+
+template <typename S, size_t Pos>
+struct StaticParseCompare {
+    using First = StaticParsePrimary<S, Pos>;
+    using Tail = StaticParseCompareTail<S, typename First::Type, StaticText::Skip(S::Str(), First::End)>;
+    static constexpr size_t End = Tail::End;
+    using Type = typename Tail::Type;
+};
+
+// '&' and '|', left to right after the first operand Acc
+template <typename S, typename Acc, size_t Pos, char C = S::Str()[Pos]>
+struct StaticParseLogicTail {
+    static constexpr size_t End = Pos;
+    using Type = Acc;
+};
+
+template <typename S, typename Acc, size_t Pos, Expression::CmpOp Op>
+struct StaticParseLogicStep {
+    using Rhs = StaticParseCompare<S, StaticText::Skip(S::Str(), Pos + 1)>;
+    using Next = StaticParseLogicTail<S, StaticLogic<Acc, Op, typename Rhs::Type>, StaticText::Skip(S::Str(), Rhs::End)>;
+    static constexpr size_t End = Next::End;
+    using Type = typename Next::Type;
+};
+
+template <typename S, typename Acc, size_t Pos>
+struct StaticParseLogicTail<S, Acc, Pos, '&'> : StaticParseLogicStep<S, Acc, Pos, Expression::And> {};
+template <typename S, typename Acc, size_t Pos>
+struct StaticParseLogicTail<S, Acc, Pos, '|'> : StaticParseLogicStep<S, Acc, Pos, Expression::Or> {};
+
+template <typename S, size_t Pos>
+struct StaticParseLogic {
+    using First = StaticParseCompare<S, Pos>;
+    using Tail = StaticParseLogicTail<S, typename First::Type, StaticText::Skip(S::Str(), First::End)>;
+    static constexpr size_t End = Tail::End;
+    using Type = typename Tail::Type;
+};
+
+template <typename S>
+class StaticExpression {
+    using Parsed = StaticParseLogic<S, StaticText::Skip(S::Str(), 0)>;
+    static_assert(S::Str()[StaticText::Skip(S::Str(), Parsed::End)] == 0, "unexpected character");
+
+    static constexpr size_t Params = StaticText::Names(S::Str(), 0, StaticText::Length(S::Str()));
+
+public:
+    using Tree = typename Parsed::Type;
+
+    template <typename iterable>
+    inline static bool Match(const iterable &props) {
+        StaticSlot slots[Params > 0 ? Params : 1];
+        for (StaticSlot &slot: slots)
+            slot.type = Expression::PropNone;
+
+        size_t pending = Params;
+        size_t tot = props.size();
+        for (auto it = props.begin(); tot > 0 && pending > 0; ++it, --tot) {
+            auto type = it->Type();
+            if (type != Expression::PropString && type != Expression::PropInt && type != Expression::PropFloat)
+                continue;
+            pending -= Tree::Bind(it, it->Name(), it->NameLen(), slots);
+        }
+        return Tree::Eval(slots).ans != Expression::False;
+    }
+};
@@ -0,0 +1,1237 @@
+#include <chrono>
+#include <deque>
+#include <iostream>
+#include <random>
+#include <thread>
+#include "rapidjson/document.h"
+#include "batch.h"
+#include "counters.h"
+#include "gen.h"
+#include "jit.h"
+#include "latency.h"
+#include "parallel.h"
+#include "ruleset.h"
+#include "saxmatch.h"
+#include "staticexp.h"
+
+// Regression tests, a section per change. Seeded rules and rows from gen.h,
+// and hand-written rules covering what gen does not write, go through every
+// engine, which must agree with Reference: an evaluator of the rule text
+// written apart from expression.h, so a fault of the parser or of Program
+// cannot hide in the expected results too. Each failure is printed, up to a
+// limit, and the exit status is 1 if any.
+//
+// Usage: ./test [--seed n]     (or 'make test')
+
+// One property of a row, in the interface Expressions::Match reads
+struct Prop {
+    std::string name;
+    Expression::PropType type;
+    std::string str;
+    Expression::PropValInt val_int;
+    Expression::PropValFloat val_float;
+
+    inline const char * Name() const {
+        return name.data();
+    }
+    inline size_t NameLen() const {
+        return name.size();
+    }
+    inline Expression::PropType Type() const {
+        return type;
+    }
+    inline const char * String() const {
+        return str.data();
+    }
+    inline size_t ValLen() const {
+        return str.size();
+    }
+    inline Expression::PropValInt Int() const {
+        return val_int;
+    }
+    inline Expression::PropValFloat Float() const {
+        return type == Expression::PropInt ? (Expression::PropValFloat)val_int : val_float;
+    }
+};
+
+struct Rows {
+    vector<std::string> json;
+    std::string ndjson;
+    vector<vector<Prop>> props;
+    // Attributes in order of first sight, with the type of their values
+    vector<std::string> names;
+    vector<Expression::PropType> types;
+
+    void Add(const std::string &line) {
+        json.push_back(line);
+        ndjson += line + "\n";
+        rapidjson::Document doc;
+        doc.Parse(line.c_str());
+        assert(doc.IsObject());
+        props.emplace_back();
+        for (auto it = doc.MemberBegin(); it != doc.MemberEnd(); ++it) {
+            Prop prop;
+            prop.name = it->name.GetString();
+            prop.val_int = 0;
+            prop.val_float = 0;
+            if (it->value.IsString()) {
+                prop.type = Expression::PropString;
+                prop.str = it->value.GetString();
+            } else if (it->value.IsInt()) {
+                prop.type = Expression::PropInt;
+                prop.val_int = it->value.GetInt();
+            } else {
+                prop.type = Expression::PropFloat;
+                prop.val_float = (Expression::PropValFloat)it->value.GetDouble();
+            }
+            if (std::find(names.begin(), names.end(), prop.name) == names.end()) {
+                names.push_back(prop.name);
+                types.push_back(prop.type);
+            }
+            props.back().push_back(prop);
+        }
+    }
+};
+
+class Failures {
+    size_t count;
+
+public:
+    inline Failures(): count(0) {}
+
+    inline void Check(const bool &ok, const std::string &engine, const std::string &rule, const size_t &row) {
+        if (ok)
+            return;
+        if (++count <= 20)
+            std::cerr << "FAIL " << engine << ": rule '" << rule << "' row " << row << std::endl;
+    }
+    inline void Check(const bool &ok, const std::string &what) {
+        if (ok)
+            return;
+        if (++count <= 20)
+            std::cerr << "FAIL " << what << std::endl;
+    }
+    inline size_t Count() const {
+        return count;
+    }
+};
+
+// What a rule means, worked out the slow and obvious way: tokens to postfix
+// by precedence ('=', '<', '>', '<=' and '>=' over '&' and '|', which bind
+// alike, left to right), then a stack of values that keep their own type.
+//
+// A comparison on a missing parameter is True, one of a string with a number
+// False, and numbers compare as floats unless both are ints. Strings are
+// equal by their bytes and ordered by Hash of them. Operands of '&' and '|'
+// that are no comparison are Undefined, which changes neither, as are those
+// of a comparison of comparisons, where Undefined compares True and False
+// below True. A rule matches unless it comes out False.
+class Reference {
+    enum Truth {Undefined, False, True};
+
+    struct Value {
+        // 'm'issing, 'i'nt, 'f'loat, 's'tring or 'b'ool
+        char kind;
+        int32_t i;
+        float f;
+        std::string s;
+        Truth b;
+    };
+
+    struct Token {
+        // 'v'alue, 'p'arameter, 'o'perator or '('
+        char kind;
+        std::string text;
+        Value value;
+    };
+
+    vector<Token> postfix;
+
+    inline static int Precedence(const std::string &op) {
+        return op == "&" || op == "|" ? 0 : 1;
+    }
+
+    inline static Value Bool(const Truth &b) {
+        return Value{'b', 0, 0, "", b};
+    }
+
+    inline static Truth Of(const Value &v) {
+        return v.kind == 'b' ? v.b : Undefined;
+    }
+
+    template <typename T>
+    inline static bool Order(const T &a, const std::string &op, const T &b) {
+        if (op == "=")
+            return a == b;
+        if (op == ">=")
+            return a >= b;
+        if (op == "<=")
+            return a <= b;
+        if (op == ">")
+            return a > b;
+        return a < b;
+    }
+
+    static Value Apply(const std::string &op, const Value &l, const Value &r) {
+        if (op == "&" || op == "|") {
+            Truth a = Of(l), b = Of(r);
+            if (a == Undefined)
+                return Bool(b);
+            if (b == Undefined)
+                return Bool(a);
+            bool both = a == True && b == True, either = a == True || b == True;
+            return Bool((op == "&" ? both : either) ? True : False);
+        }
+        if (l.kind == 'b' || r.kind == 'b') {
+            Truth a = Of(l), b = Of(r);
+            if (a == Undefined || b == Undefined)
+                return Bool(True);
+            return Bool(Order((int)a, op, (int)b) ? True : False);
+        }
+        if (l.kind == 'm' || r.kind == 'm')
+            return Bool(True);
+        if ((l.kind == 's') != (r.kind == 's'))
+            return Bool(False);
+        bool holds;
+        if (l.kind == 's' && op == "=")
+            holds = l.s == r.s;
+        else if (l.kind == 's')
+            holds = Order(Hash(l.s.data(), l.s.size()), op, Hash(r.s.data(), r.s.size()));
+        else if (l.kind == 'i' && r.kind == 'i')
+            holds = Order(l.i, op, r.i);
+        else
+            holds = Order(l.kind == 'i' ? (float)l.i : l.f, op, r.kind == 'i' ? (float)r.i : r.f);
+        return Bool(holds ? True : False);
+    }
+
+public:
+    explicit Reference(const std::string &rule) {
+        vector<Token> ops;
+        auto pop = [&]() {
+            postfix.push_back(ops.back());
+            ops.pop_back();
+        };
+        for (size_t i = 0; i < rule.size(); ) {
+            char c = rule[i];
+            if (isblank(c)) {
+                ++i;
+            } else if (isalpha(c)) {
+                size_t j = i;
+                while (j < rule.size() && (isalnum(rule[j]) || rule[j] == '_'))
+                    ++j;
+                postfix.push_back(Token{'p', rule.substr(i, j - i), Value()});
+                i = j;
+            } else if (isdigit(c) || c == '-') {
+                size_t j = i + 1;
+                while (j < rule.size() && (isdigit(rule[j]) || rule[j] == '.'))
+                    ++j;
+                std::string text = rule.substr(i, j - i);
+                Value v{'i', 0, 0, "", Undefined};
+                if (text.find('.') == std::string::npos) {
+                    v.i = std::stoi(text);
+                } else {
+                    v.kind = 'f';
+                    v.f = std::stof(text);
+                }
+                postfix.push_back(Token{'v', text, v});
+                i = j;
+            } else if (c == '\'') {
+                size_t j = rule.find('\'', i + 1);
+                postfix.push_back(Token{'v', "", Value{'s', 0, 0, rule.substr(i + 1, j - i - 1), Undefined}});
+                i = j + 1;
+            } else if (c == '(') {
+                ops.push_back(Token{'(', "(", Value()});
+                ++i;
+            } else if (c == ')') {
+                while (ops.back().kind != '(')
+                    pop();
+                ops.pop_back();
+                ++i;
+            } else {
+                std::string op(1, c);
+                ++i;
+                if (c != '&' && c != '|' && i < rule.size() && rule[i] == '=') {
+                    if (c != '=')
+                        op += '=';
+                    ++i;
+                }
+                while (!ops.empty() && ops.back().kind == 'o' && Precedence(ops.back().text) >= Precedence(op))
+                    pop();
+                ops.push_back(Token{'o', op, Value()});
+            }
+        }
+        while (!ops.empty())
+            pop();
+    }
+
+    bool Match(const vector<Prop> &row) const {
+        vector<Value> stack;
+        for (const Token &token: postfix) {
+            if (token.kind == 'v') {
+                stack.push_back(token.value);
+            } else if (token.kind == 'p') {
+                Value v{'m', 0, 0, "", Undefined};
+                for (const Prop &prop: row) {
+                    if (prop.name != token.text)
+                        continue;
+                    if (prop.type == Expression::PropString) {
+                        v.kind = 's';
+                        v.s = prop.str;
+                    } else if (prop.type == Expression::PropInt) {
+                        v.kind = 'i';
+                        v.i = prop.val_int;
+                    } else {
+                        v.kind = 'f';
+                        v.f = prop.val_float;
+                    }
+                    break;
+                }
+                stack.push_back(v);
+            } else {
+                Value r = stack.back();
+                stack.pop_back();
+                Value l = stack.back();
+                stack.pop_back();
+                stack.push_back(Apply(token.text, l, r));
+            }
+        }
+        return stack.empty() || Of(stack.back()) != False;
+    }
+};
+
+// A rule, and whether Reference matches each row
+struct Case {
+    std::string rule;
+    vector<bool> expected;
+
+    Case(const std::string &rule_, const Rows &rows) : rule(rule_) {
+        Reference reference(rule);
+        for (const vector<Prop> &row: rows.props)
+            expected.push_back(reference.Match(row));
+    }
+};
+
+// A hand-written rule with $i, $j, $s and $t replaced by attributes the rows
+// hold, two of ints and two of strings if there are
+std::string Fill(const std::string &rule, const Rows &rows) {
+    vector<std::string> ints, strings;
+    for (size_t i = 0; i < rows.names.size(); ++i)
+        (rows.types[i] == Expression::PropString ? strings : ints).push_back(rows.names[i]);
+    for (vector<std::string> *names: {&ints, &strings}) {
+        names->insert(names->end(), rows.names.begin(), rows.names.end());
+        names->resize(2);
+    }
+    std::string out;
+    for (size_t i = 0; i < rule.size(); ++i) {
+        if (rule[i] != '$' || i + 1 == rule.size()) {
+            out += rule[i];
+            continue;
+        }
+        char c = rule[++i];
+        out += c == 'i' ? ints[0] : c == 'j' ? ints[1] : c == 's' ? strings[0] : strings[1];
+    }
+    return out;
+}
+
+inline Prop Int(const std::string &name, const Expression::PropValInt &val) {
+    return Prop{name, Expression::PropInt, "", val, 0};
+}
+inline Prop Float(const std::string &name, const Expression::PropValFloat &val) {
+    return Prop{name, Expression::PropFloat, "", 0, val};
+}
+inline Prop String(const std::string &name, const std::string &val) {
+    return Prop{name, Expression::PropString, val, 0, 0};
+}
+
+// Parses a rule, failing if it takes over a second, as a quadratic pass over
+// rules of 10^4 operands would
+void Compile(Expressions &exp, const std::string &rule, const std::string &what, Failures &fail) {
+    auto start = std::chrono::steady_clock::now();
+    exp.Parse(rule.c_str());
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    fail.Check(seconds < 1, what + " took " + std::to_string(seconds) + " s to compile");
+}
+
+// Match of a rule against Reference over rows made by hand
+void Agree(const std::string &rule, const vector<vector<Prop>> &rows, const std::string &what, Failures &fail) {
+    Reference reference(rule);
+    Expressions exp;
+    exp.Parse(rule.c_str());
+    Expressions::Context ctx;
+    for (size_t i = 0; i < rows.size(); ++i)
+        fail.Check(exp.Match(rows[i], ctx) == reference.Match(rows[i]), what, rule, i);
+}
+
+// Program: Match on the owned Context and on the caller's, over the cases
+// and over every operator on ints, floats, strings and missing values
+// against constants of each type and another parameter
+void Programs(const vector<Case> &cases, const Rows &rows, Failures &fail) {
+    for (const Case &c: cases) {
+        Expressions exp;
+        exp.Parse(c.rule.c_str());
+        Expressions::Context ctx;
+        for (size_t i = 0; i < rows.props.size(); ++i) {
+            fail.Check(exp.Match(rows.props[i], ctx) == c.expected[i], "program", c.rule, i);
+            fail.Check(exp.Match(rows.props[i]) == c.expected[i], "program-owned", c.rule, i);
+        }
+    }
+
+    vector<Prop> xs{Int("x", 3), Int("x", -2), Float("x", 3.0f), Float("x", 2.5f), String("x", "3"),
+                    String("x", "b")};
+    vector<Prop> ys{Int("y", 3), Float("y", 2.5f), String("y", "b")};
+    vector<vector<Prop>> typed{{}};
+    for (const Prop &x: xs) {
+        typed.push_back({x});
+        for (const Prop &y: ys)
+            typed.push_back({x, y});
+    }
+    for (const Prop &y: ys)
+        typed.push_back({y});
+    for (const char *op: {"=", ">=", "<=", ">", "<"}) {
+        for (const char *rhs: {"3", "2.5", "-2", "'b'", "'3'", "y"}) {
+            std::string rule = std::string("x ") + op + " " + rhs;
+            Reference reference(rule);
+            Expressions exp;
+            exp.Parse(rule.c_str());
+            for (size_t i = 0; i < typed.size(); ++i)
+                fail.Check(exp.Match(typed[i]) == reference.Match(typed[i]), "program-typed", rule, i);
+        }
+    }
+}
+
+// Short-circuits: a decided '&' or '|' runs no more compares, one left
+// Undefined by a missing parameter or bare value decides nothing
+void ShortCircuits(Failures &fail) {
+    struct Run {
+        const char *rule;
+        vector<Prop> row;
+        uint64_t compares;
+    };
+    vector<Run> runs{
+        {"a = 1 & b = 2 & c = 3", {Int("a", 2)}, 1},
+        {"a = 1 & b = 2 & c = 3", {Int("a", 1), Int("b", 3)}, 2},
+        {"a = 1 & b = 2 & c = 3", {Int("b", 2)}, 3},
+        {"a = 1 | b = 2 | c = 3", {Int("a", 1)}, 1},
+        {"a = 1 | b = 2 | c = 3", {Int("a", 2), Int("b", 3), Int("c", 4)}, 3},
+        {"(a = 1 | b = 2) & c = 3", {Int("a", 2), Int("b", 3)}, 2},
+        {"(a = 1 | b = 2) & c = 3", {Int("a", 1), Int("c", 3)}, 2},
+        {"x & a = 1 & b = 2", {Int("a", 2)}, 1},
+    };
+    for (const Run &run: runs) {
+        Expressions exp;
+        exp.Parse(run.rule);
+        const Program &program = exp.Compiled();
+        Expressions::Context ctx;
+        exp.Load(run.row, ctx);
+        vector<Program::Stat> stats(program.code.size());
+        bool matched = program.Run(ctx.slots.data(), ctx.regs.data(), stats.data()).ans != Expression::False;
+        uint64_t compares = 0;
+        for (size_t i = 0; i < program.code.size(); ++i)
+            if (program.code[i].code < Instruction::Load)
+                compares += stats[i].evals;
+        fail.Check(matched == Reference(run.rule).Match(run.row) && compares == run.compares,
+                   std::string("short-circuit of ") + run.rule + " ran " + std::to_string(compares) + " compares");
+    }
+}
+
+// SaxMatcher: rows straight from their JSON text, numbers of any size bound
+// as the DOM rows of Reference read them
+void Saxes(const vector<Case> &cases, const Rows &rows, Failures &fail) {
+    for (const Case &c: cases) {
+        Expressions exp;
+        exp.Parse(c.rule.c_str());
+        SaxMatcher sax(exp);
+        for (size_t i = 0; i < rows.props.size(); ++i)
+            fail.Check(sax.Match(rows.json[i].c_str()) == c.expected[i], "sax", c.rule, i);
+    }
+
+    Rows numbers;
+    for (const char *line: {R"({"x": 2147483647})", R"({"x": -2147483648})", R"({"x": 3000000000})",
+                            R"({"x": -3000000000})", R"({"x": 4294967296})", R"({"x": 9007199254740993})",
+                            R"({"x": -9007199254740993})", R"({"x": 1e3})", R"({"x": 5.0})"})
+        numbers.Add(line);
+    for (const char *rule: {"x = 2147483647", "x > 2147483000", "x < -2000000000", "x >= 1000", "x = 5",
+                            "x <= -2147483648", "x > 0 & x < 10"}) {
+        Case c(rule, numbers);
+        Expressions exp;
+        exp.Parse(rule);
+        SaxMatcher sax(exp);
+        for (size_t i = 0; i < numbers.props.size(); ++i)
+            fail.Check(sax.Match(numbers.json[i].c_str()) == c.expected[i], "sax-numbers", rule, i);
+    }
+}
+
+// RuleSet: all rules at once, each row's ids against Reference, touching
+// only rules that may match
+void RuleSets(const vector<Case> &cases, const Rows &rows, Failures &fail) {
+    RuleSet set;
+    for (const Case &c: cases)
+        set.Add(c.rule.c_str());
+    vector<RuleSet::RuleId> matched;
+    for (size_t i = 0; i < rows.props.size(); ++i) {
+        matched.clear();
+        set.Match(rows.props[i], matched);
+        std::sort(matched.begin(), matched.end());
+        for (size_t r = 0; r < cases.size(); ++r)
+            fail.Check(std::binary_search(matched.begin(), matched.end(), r) == cases[r].expected[i], "ruleset",
+                       cases[r].rule, i);
+    }
+
+    // Of rules needing a = i, a row evaluates the one whose predicate holds
+    RuleSet narrow;
+    for (int i = 0; i < 1000; ++i)
+        narrow.Add(("a = " + std::to_string(i) + " & b > 2").c_str());
+    narrow.Sort();
+    RuleSet::Context ctx;
+    matched.clear();
+    narrow.Match(vector<Prop>{Int("a", 7), Int("b", 1)}, matched, ctx);
+    fail.Check(matched.empty() && ctx.touched.size() == 1, "ruleset evaluates only the rule of a = 7");
+    narrow.Match(vector<Prop>{Int("a", 7), Int("b", 3)}, matched, ctx);
+    fail.Check(matched == vector<RuleSet::RuleId>{7}, "ruleset matches a = 7 & b > 2");
+}
+
+// The rows as a ColumnBlock, string values coded for one Expressions
+struct Columns {
+    vector<vector<Expression::PropValInt>> ints;
+    vector<vector<Expression::PropValFloat>> floats;
+    vector<vector<HashCode>> codes;
+    vector<vector<uint64_t>> nulls;
+    ColumnBlock block;
+
+    Columns(const Rows &rows, const Expressions &exp) : block(rows.props.size()) {
+        size_t n = rows.names.size();
+        ints.assign(n, vector<Expression::PropValInt>(block.rows, 0));
+        floats.assign(n, vector<Expression::PropValFloat>(block.rows, 0));
+        codes.assign(n, vector<HashCode>(block.rows, 0));
+        nulls.assign(n, vector<uint64_t>(block.Words(), ~0ULL));
+        for (size_t i = 0; i < block.rows; ++i) {
+            for (const Prop &prop: rows.props[i]) {
+                size_t c = std::find(rows.names.begin(), rows.names.end(), prop.name) - rows.names.begin();
+                nulls[c][i / 64] &= ~(1ULL << (i % 64));
+                if (prop.type == Expression::PropString)
+                    codes[c][i] = exp.Code(prop.str.data(), prop.str.size());
+                else if (prop.type == Expression::PropInt)
+                    ints[c][i] = prop.val_int;
+                else
+                    floats[c][i] = prop.val_float;
+            }
+        }
+        for (size_t c = 0; c < n; ++c) {
+            const char *name = rows.names[c].c_str();
+            if (rows.types[c] == Expression::PropString)
+                block.Add(name, codes[c].data(), nulls[c].data());
+            else if (rows.types[c] == Expression::PropInt)
+                block.Add(name, ints[c].data(), nulls[c].data());
+            else
+                block.Add(name, floats[c].data(), nulls[c].data());
+        }
+    }
+};
+
+// BatchMatcher: one matcher over the whole block, then over its first 100
+// rows, reusing the masks of rows parked by jumps
+void Batches(const vector<Case> &cases, const Rows &rows, Failures &fail) {
+    for (const Case &c: cases) {
+        Expressions exp;
+        exp.Parse(c.rule.c_str());
+        Columns columns(rows, exp);
+        ColumnBlock head(std::min<size_t>(100, columns.block.rows));
+        head.columns = columns.block.columns;
+        BatchMatcher batch(exp.Compiled());
+        for (const ColumnBlock *block: {&columns.block, &head}) {
+            vector<uint64_t> selection(block->Words());
+            batch.Match(*block, selection.data());
+            for (size_t i = 0; i < block->rows; ++i)
+                fail.Check((selection[i / 64] >> (i % 64) & 1) == c.expected[i], "batch", c.rule, i);
+        }
+    }
+}
+
+// Simd: a matcher per level, all at once on threads of their own, and the
+// mask kernels against their word loops over a tail short of a vector
+void Simds(const vector<Case> &cases, const Rows &rows, Failures &fail) {
+    static const Simd::Isa levels[] = {Simd::Scalar, Simd::Sse2, Simd::Avx2};
+    static const char *names[] = {"batch-scalar", "batch-sse2", "batch-avx2"};
+    for (const Case &c: cases) {
+        Expressions exp;
+        exp.Parse(c.rule.c_str());
+        Columns columns(rows, exp);
+        vector<vector<uint64_t>> selections(3, vector<uint64_t>(columns.block.Words()));
+        vector<std::thread> threads;
+        for (int l = 0; l < 3; ++l)
+            threads.emplace_back([&, l]() {
+                BatchMatcher(exp.Compiled()).Use(levels[l]).Match(columns.block, selections[l].data());
+            });
+        for (std::thread &thread: threads)
+            thread.join();
+        for (int l = 0; l < 3; ++l)
+            for (size_t i = 0; i < rows.props.size(); ++i)
+                fail.Check((selections[l][i / 64] >> (i % 64) & 1) == c.expected[i], names[l], c.rule, i);
+    }
+
+    std::mt19937_64 random(7);
+    const size_t words = 11;
+    vector<uint64_t> a(words), b(words), mask(words);
+    for (size_t w = 0; w < words; ++w) {
+        a[w] = random();
+        b[w] = random();
+        mask[w] = random();
+    }
+    for (int l = 0; l < 3; ++l) {
+        Simd::Isa isa = std::min(levels[l], Simd::Detect());
+        vector<uint64_t> ands = a, nots = a, ors = a, blends = a;
+        Simd::And(isa, ands.data(), b.data(), words);
+        Simd::AndNot(isa, nots.data(), b.data(), words);
+        Simd::Or(isa, ors.data(), b.data(), words);
+        Simd::Blend(isa, blends.data(), b.data(), mask.data(), words);
+        bool ok = true;
+        for (size_t w = 0; w < words; ++w)
+            ok = ok && ands[w] == (a[w] & b[w]) && nots[w] == (a[w] & ~b[w]) && ors[w] == (a[w] | b[w]) &&
+                 blends[w] == ((a[w] & ~mask[w]) | (b[w] & mask[w]));
+        fail.Check(ok, std::string(names[l]) + " mask kernels");
+    }
+}
+
+// Slot map: a slot per distinct parameter, and rows in any order, with
+// names the rule does not read and names given twice, the first binding
+void Slots(Failures &fail) {
+    const char *rule = "a = 1 & b < 'm' | c >= 2.5 & a = c | (b = 'z') = (a > 1)";
+    Expressions exp;
+    exp.Parse(rule);
+    vector<int> slots;
+    for (const char *name: {"a", "b", "c"})
+        slots.push_back(exp.Find(name, 1));
+    bool ok = exp.Params() == 3 && exp.Find("x", 1) < 0 && exp.Find("ab", 2) < 0;
+    for (size_t i = 0; i < slots.size(); ++i)
+        ok = ok && slots[i] >= 0 && slots[i] < 3 && exp.Name(slots[i]) == std::string(1, "abc"[i]) &&
+             std::count(slots.begin(), slots.end(), slots[i]) == 1;
+    fail.Check(ok, "a slot per parameter");
+
+    std::mt19937 random(5);
+    vector<vector<Prop>> rows;
+    for (int n = 0; n < 400; ++n) {
+        vector<Prop> row;
+        if (random() % 4 != 0)
+            row.push_back(Int("a", random() % 3));
+        if (random() % 4 != 0)
+            row.push_back(String("b", random() % 2 ? "a" : "z"));
+        if (random() % 4 != 0)
+            row.push_back(random() % 2 ? Int("c", 1) : Float("c", 3.0f));
+        for (int k = random() % 4; k > 0; --k)
+            row.push_back(random() % 2 ? Int("x", 1) : String("ab", "z"));
+        std::shuffle(row.begin(), row.end(), random);
+        if (random() % 3 == 0)
+            row.push_back(Int(random() % 2 ? "a" : "c", 2));
+        rows.push_back(row);
+    }
+    Agree(rule, rows, "slots", fail);
+}
+
+// Wide rows: 80 properties in any order against a rule reading 20 of them
+// and one reading only the last, some rows missing parameters or giving them
+// twice
+void Widths(Failures &fail) {
+    std::string wide;
+    for (int k = 0; k < 20; ++k)
+        wide += (k == 0 ? "" : k % 5 == 0 ? " | " : " & ") + ("p" + std::to_string(4 * k)) + (k % 2 ? " >= " : " < ") +
+                std::to_string(k % 7 + 1);
+    std::mt19937 random(8);
+    vector<vector<Prop>> rows;
+    for (int n = 0; n < 400; ++n) {
+        vector<Prop> row;
+        for (int k = 0; k < 80; ++k)
+            if (random() % 16 != 0)
+                row.push_back(Int("p" + std::to_string(k), random() % 10));
+        std::shuffle(row.begin(), row.end(), random);
+        for (int k = random() % 3; k > 0; --k)
+            row.push_back(Int("p" + std::to_string(random() % 80), random() % 10));
+        rows.push_back(row);
+    }
+    Agree(wide, rows, "wide", fail);
+    Agree("p79 = 3", rows, "wide", fail);
+}
+
+// Name prefilter: names alike in length and first and last bytes, past 63
+// bytes, empty or of bytes over 127 pass or not, but only the names the rule
+// reads bind
+void Prefilters(Failures &fail) {
+    std::string longer = "l" + std::string(68, 'x') + "z";
+    std::string rule = "ab = 1 & a_b < 5 | " + longer + " = 'v' & Z9 > 2";
+    vector<std::string> reads{"ab", "a_b", longer, "Z9"};
+    vector<std::string> others{"aab", "axb", "a_c", "l" + std::string(67, 'x') + "yz", longer + "zz", "", "Z", "Z99",
+                               "\xc3\xa9" "b", "b"};
+    Expressions exp;
+    exp.Parse(rule.c_str());
+    bool ok = true;
+    for (const std::string &name: reads)
+        ok = ok && exp.Find(name.data(), name.size()) >= 0;
+    for (const std::string &name: others)
+        ok = ok && exp.Find(name.data(), name.size()) < 0;
+    fail.Check(ok, "only the names read bind");
+
+    std::mt19937 random(9);
+    vector<vector<Prop>> rows;
+    for (int n = 0; n < 400; ++n) {
+        vector<Prop> row;
+        for (const std::string &name: others)
+            if (random() % 2 == 0)
+                row.push_back(random() % 2 ? Int(name, random() % 8) : String(name, std::string(200, 'v')));
+        for (size_t k = 0; k < reads.size(); ++k)
+            if (random() % 4 != 0)
+                row.push_back(k == 2 ? String(reads[k], random() % 2 ? "v" : "w") : Int(reads[k], random() % 8));
+        std::shuffle(row.begin(), row.end(), random);
+        rows.push_back(row);
+    }
+    Agree(rule, rows, "prefilter", fail);
+}
+
+// Simplification: redundant rules shrink to what they decide, and still
+// match as written, rows missing the parameter included
+void Simplifies(const Rows &rows, Failures &fail) {
+    struct Shrink {
+        const char *rule;
+        size_t code;
+    };
+    vector<Shrink> shrinks{
+        {"$i > 5 & $i > 7", 1}, {"$i > 5 & $i < 3", 1}, {"$i >= 3 & $i <= 3", 1}, {"$i > 2 | $i > 5", 1},
+        {"$i = 3 & $i = 3", 1}, {"$s = 'v1' | $s = 'v1'", 1}, {"(1 = 1) & $i > 5", 1}, {"1 = 2 & $i > 1", 1},
+        {"1 = 1 | $i > 3", 1}, {"$i > 5 & $j < 2 & $i > 5", 3},
+    };
+    for (const Shrink &shrink: shrinks) {
+        Case c(Fill(shrink.rule, rows), rows);
+        Expressions exp;
+        exp.Parse(c.rule.c_str());
+        size_t code = exp.Compiled().code.size();
+        fail.Check(code <= shrink.code, "'" + c.rule + "' compiled to " + std::to_string(code) + " instructions");
+        Expressions::Context ctx;
+        for (size_t i = 0; i < rows.props.size(); ++i)
+            fail.Check(exp.Match(rows.props[i], ctx) == c.expected[i], "simplified", c.rule, i);
+    }
+}
+
+// Chains of 10^4 operands under one '&' or '|'
+void Chains(Failures &fail) {
+    const int n = 10000;
+    std::string ands, ors, bounds;
+    for (int i = 0; i < n; ++i) {
+        ands += (i > 0 ? " & a = " : "a = ") + std::to_string(i);
+        ors += (i > 0 ? " | p" : "p") + std::to_string(i) + " = 'v'";
+        bounds += (i > 0 ? " & a > " : "a > ") + std::to_string(i) + " & a < " + std::to_string(2 * n - i);
+    }
+    Expressions exp;
+    Compile(exp, ands, "a chain of '=' under '&'", fail);
+    fail.Check(!exp.Match(vector<Prop>{Int("a", 7)}) && exp.Match(vector<Prop>{Int("b", 7)}), "a chain of '=' under '&'");
+    Compile(exp, ors, "a chain of '=' under '|'", fail);
+    vector<Prop> row;
+    for (int i = 0; i < n; ++i)
+        row.push_back(String("p" + std::to_string(i), "w"));
+    bool none = exp.Match(row);
+    row.back().str = "v";
+    fail.Check(!none && exp.Match(row), "a chain of '=' under '|'");
+    Compile(exp, bounds, "a chain of bounds under '&'", fail);
+    fail.Check(exp.Compiled().code.size() == 1 && exp.Match(vector<Prop>{Int("a", n)}) &&
+               !exp.Match(vector<Prop>{Int("a", n - 1)}), "a chain of bounds under '&'");
+}
+
+// Adapt: operands reordered every 16 rows while the rows stream through,
+// each still matching as Reference reads the rule
+void Adapts(const vector<Case> &cases, const Rows &rows, Failures &fail) {
+    for (const Case &c: cases) {
+        Expressions exp;
+        exp.Parse(c.rule.c_str());
+        exp.Adapt(16);
+        for (size_t i = 0; i < rows.props.size(); ++i)
+            fail.Check(exp.Match(rows.props[i]) == c.expected[i], "adaptive", c.rule, i);
+    }
+}
+
+// Adapt ranks a range by how often it held: always True, it goes before an
+// operand of '|' True on 3 rows in 10, though as an '&' of two bounds it
+// would not
+void Ranges(Failures &fail) {
+    Expressions exp;
+    exp.Parse("b = 1 | (a > 0 & a < 10)");
+    fail.Check(exp.Compiled().code[0].code == Instruction::CmpInt + Expression::Eq, "'b = 1' first as written");
+    exp.Adapt(16);
+    for (int i = 0; i < 160; ++i)
+        exp.Match(vector<Prop>{Int("a", 5), Int("b", i % 10 < 3 ? 1 : 2)});
+    fail.Check(exp.Compiled().code[0].code == Instruction::RangeInt, "a range ranked by its statistics");
+}
+
+// Strings: two values of one Hash, found by trying names until two share it,
+// stay apart when compared with literals, in rows and in columns
+void Collisions(Failures &fail) {
+    std::unordered_map<HashCode, std::string> seen;
+    std::string a, b;
+    for (uint32_t n = 0; a.empty(); ++n) {
+        std::string name = "k" + std::to_string(n);
+        auto it = seen.emplace(Hash(name.data(), name.size()), name);
+        if (!it.second) {
+            a = it.first->second;
+            b = name;
+        }
+    }
+    vector<vector<Prop>> rows{{String("x", a)}, {String("x", b)}, {String("x", "c")}, {String("x", a), String("y", b)},
+                              {String("x", b), String("y", b)}, {String("y", a)}};
+    for (const std::string &rule: {"x = '" + a + "'", "x = '" + b + "'", "x = '" + a + "' | x = '" + b + "'",
+                                   "x = '" + a + "' & y = '" + b + "'", "x = '" + a + "' | y = 'c'"})
+        Agree(rule, rows, "collision of '" + a + "' and '" + b + "'", fail);
+
+    Expressions exp;
+    exp.Parse(("x = '" + a + "'").c_str());
+    vector<HashCode> codes{exp.Code(a.data(), a.size()), exp.Code(b.data(), b.size())};
+    ColumnBlock block(2);
+    block.Add("x", codes.data());
+    uint64_t selection;
+    BatchMatcher(exp.Compiled()).Match(block, &selection);
+    fail.Check(selection == 1, "batch collision of '" + a + "' and '" + b + "'");
+}
+
+// Hash policies: the bytes alone decide the hash, wherever they lie and
+// whatever follows them, and a byte changed anywhere changes it
+template <typename H>
+void Hashes(const char *policy, Failures &fail) {
+    std::mt19937 random(13);
+    std::string text(80, 0), other(96, 0);
+    for (char &c: text)
+        c = (char)(random() % 256);
+    bool ok = true;
+    for (size_t len = 0; len <= 40; ++len) {
+        HashCode hash = H::Hash(text.data(), len);
+        for (size_t at = 1; at < 8; ++at) {
+            for (char &c: other)
+                c = (char)(random() % 256);
+            std::copy(text.begin(), text.begin() + len, other.begin() + at);
+            ok = ok && H::Hash(&other[at], len) == hash;
+        }
+        for (size_t i = 0; i < len; ++i) {
+            std::string changed = text.substr(0, len);
+            changed[i] ^= 1;
+            ok = ok && H::Hash(changed.data(), len) != hash;
+        }
+    }
+    fail.Check(ok, std::string(policy) + " hashes bytes alike at any address");
+}
+
+STATIC_EXPRESSION(Static0, "a0 < 5 & a1 >= 3");
+STATIC_EXPRESSION(Static1, "a1 = 'v1' | a2 < 10 & a3 >= 2");
+STATIC_EXPRESSION(Static2, "(a0 < 5 | a1 > 7) & (a2 = a3 | a4 <= 2.5)");
+STATIC_EXPRESSION(Static3, "a5 > 1.5 | a6 = 'v0'");
+STATIC_EXPRESSION(Static4, "(a0 < 3 | a7 = 'v2') & a1 < 9 & a2 >= 1");
+STATIC_EXPRESSION(Static5, "a2 >= a3 | a4 > 'v5' & (a0 < 4) = (a1 > 'v2')");
+
+// Static expressions: parsed at compile time, matching as Reference reads
+// their text
+template <typename S>
+void Statics(const char *rule, const Rows &rows, Failures &fail) {
+    Case c(rule, rows);
+    for (size_t i = 0; i < rows.props.size(); ++i)
+        fail.Check(S::Match(rows.props[i]) == c.expected[i], "static", c.rule, i);
+}
+
+// Jit: native code on every row as Reference reads the rule, and its own
+// cross-check against Program::Run on random slots
+void Jits(const vector<Case> &cases, const Rows &rows, Failures &fail) {
+    for (const Case &c: cases) {
+        Expressions exp;
+        exp.Parse(c.rule.c_str());
+        Jit jit(exp.Compiled());
+        Expressions::Context ctx;
+        const char *engine = jit.Native() ? "jit" : "jit-fallback";
+        for (size_t i = 0; i < rows.props.size(); ++i) {
+            exp.Load(rows.props[i], ctx);
+            bool matched = jit.Run(ctx.slots.data(), ctx.regs.data()).ans != Expression::False;
+            fail.Check(matched == c.expected[i], engine, c.rule, i);
+        }
+        fail.Check(jit.Check(200) == 0, std::string(engine) + " against Program::Run on '" + c.rule + "'");
+    }
+}
+
+// Sharing: four threads match every rule through the same const Expressions,
+// each with a Context of its own and rows in an order of its own
+void Shares(const vector<Case> &cases, const Rows &rows, Failures &fail) {
+    std::deque<Expressions> exps(cases.size());
+    for (size_t r = 0; r < cases.size(); ++r)
+        exps[r].Parse(cases[r].rule.c_str());
+    const std::deque<Expressions> &shared = exps;
+    const size_t n = rows.props.size();
+    vector<vector<vector<char>>> matched(4, vector<vector<char>>(cases.size(), vector<char>(n)));
+    vector<std::thread> threads;
+    for (size_t t = 0; t < 4; ++t)
+        threads.emplace_back([&, t]() {
+            Expressions::Context ctx;
+            for (size_t r = 0; r < cases.size(); ++r)
+                for (size_t k = 0; k < n; ++k) {
+                    size_t i = ((t % 2 ? n - 1 - k : k) + t * n / 4) % n;
+                    matched[t][r][i] = shared[r].Match(rows.props[i], ctx);
+                }
+        });
+    for (std::thread &thread: threads)
+        thread.join();
+    for (size_t t = 0; t < 4; ++t)
+        for (size_t r = 0; r < cases.size(); ++r)
+            for (size_t i = 0; i < n; ++i)
+                fail.Check((bool)matched[t][r][i] == cases[r].expected[i], "shared", cases[r].rule, i);
+}
+
+// Parallel: the NDJSON of the rows on pools of three workers and of one, in
+// chunks of 64 rows and of a grain rounded up to 128; and every chunk of a
+// pool's loop run once, on one worker at a time
+void Parallels(const vector<Case> &cases, const Rows &rows, Failures &fail) {
+    WorkPool three(3), one(1);
+    for (WorkPool *pool: {&three, &one}) {
+        std::string engine = "parallel-" + std::to_string(pool->Size());
+        for (size_t c = 0; c < cases.size(); ++c) {
+            Expressions exp;
+            exp.Parse(cases[c].rule.c_str());
+            ParallelMatcher parallel(exp, *pool, c % 2 ? 64 : 100);
+            vector<uint64_t> bitmap;
+            parallel.Match(rows.ndjson.data(), rows.ndjson.size(), bitmap);
+            vector<size_t> indices, expected;
+            ParallelMatcher::Indices(bitmap, indices);
+            for (size_t i = 0; i < rows.props.size(); ++i) {
+                fail.Check((bitmap[i / 64] >> (i % 64) & 1) == cases[c].expected[i], engine, cases[c].rule, i);
+                if (cases[c].expected[i])
+                    expected.push_back(i);
+            }
+            fail.Check(bitmap.size() == (rows.props.size() + 63) / 64 && indices == expected,
+                       engine + " indices of '" + cases[c].rule + "'");
+        }
+
+        vector<std::atomic<int>> runs(1000);
+        vector<std::atomic<int>> inside(pool->Size());
+        std::atomic<bool> overlapped(false);
+        pool->Run(runs.size(), [&](size_t worker, size_t chunk) {
+            overlapped = overlapped || inside[worker]++ != 0;
+            ++runs[chunk];
+            --inside[worker];
+        });
+        bool once = !overlapped;
+        for (const std::atomic<int> &run: runs)
+            once = once && run == 1;
+        fail.Check(once, engine + " runs every chunk once");
+    }
+}
+
+// Lines: NDJSON cut into rows, '\n' and "\r\n" alike, empty lines kept and
+// a last line without an end; the rows as CRLF lines match as they are
+void Lines(const vector<Case> &cases, const Rows &rows, Failures &fail) {
+    struct Cut {
+        const char *text;
+        vector<std::string> lines;
+    };
+    vector<Cut> cuts{
+        {"", {}}, {"\n", {""}}, {"\r\n", {""}}, {"a", {"a"}}, {"a\n", {"a"}}, {"a\r", {"a"}},
+        {"a\n\nb\r\nc", {"a", "", "b", "c"}}, {"a\r\n\r\n", {"a", ""}}, {"\ra\r\r\n", {"\ra\r"}},
+    };
+    vector<ParallelMatcher::Row> lines;
+    for (const Cut &cut: cuts) {
+        ParallelMatcher::Lines(cut.text, strlen(cut.text), lines);
+        vector<std::string> got;
+        for (const ParallelMatcher::Row &line: lines)
+            got.emplace_back(line.data, line.len);
+        fail.Check(got == cut.lines, "lines of '" + std::string(cut.text) + "'");
+    }
+
+    std::string crlf;
+    for (size_t i = 0; i < rows.json.size(); ++i)
+        crlf += (i > 0 ? "\r\n" : "") + rows.json[i];
+    WorkPool pool(2);
+    for (size_t c = 0; c < cases.size(); c += 10) {
+        Expressions exp;
+        exp.Parse(cases[c].rule.c_str());
+        vector<uint64_t> bitmap;
+        ParallelMatcher(exp, pool, 64).Match(crlf.data(), crlf.size(), bitmap);
+        for (size_t i = 0; i < rows.props.size(); ++i)
+            fail.Check((bitmap[i / 64] >> (i % 64) & 1) == cases[c].expected[i], "crlf", cases[c].rule, i);
+    }
+}
+
+// Decided: binding a row a property at a time, the incremental check agrees
+// with Possible worked out from scratch after every binding, and a row it
+// calls decided matches as Reference says
+void Decides(const vector<Case> &cases, const Rows &rows, Failures &fail) {
+    size_t early = 0;
+    for (const Case &c: cases) {
+        Expressions exp;
+        exp.Parse(c.rule.c_str());
+        const Program &program = exp.Compiled();
+        Expressions::Context ctx;
+        Program::Outcomes scratch;
+        for (size_t i = 0; i < rows.props.size(); ++i) {
+            exp.Reset(ctx);
+            for (const Prop &prop: rows.props[i]) {
+                int slot = exp.Find(prop.Name(), prop.NameLen());
+                if (slot < 0 || ctx.slots[slot].type != Expression::PropNone)
+                    continue;
+                if (prop.type == Expression::PropString)
+                    ctx.slots[slot].Assign(exp.Code(prop.str.data(), prop.str.size()));
+                else if (prop.type == Expression::PropInt)
+                    ctx.slots[slot].Assign(prop.val_int);
+                else
+                    ctx.slots[slot].Assign(prop.val_float);
+                bool matched;
+                bool decided = exp.Decided(ctx, slot, matched);
+                bool whole = ctx.outcomes.masks == (program.Possible(ctx.slots.data(), scratch), scratch.masks);
+                fail.Check(whole && (!decided || matched == c.expected[i]), "decided", c.rule, i);
+                if (decided) {
+                    ++early;
+                    break;
+                }
+            }
+        }
+    }
+    fail.Check(early > 0, "no row decided early");
+}
+
+// Generator: output follows the flags and seed alone, so two of one seed
+// agree, and the first row and the first rule of seed 3 are as gen writes
+// them on any machine
+void Gens(Failures &fail) {
+    const char *args[] = {"gen", "rows", "--seed", "3", "--attrs", "4", "--strlen", "3"};
+    Config config;
+    bool ok = config.Parse(8, (char **)args);
+    assert(ok);
+    (void)ok;
+    Config rule_config = config;
+    rule_config.mode = "rules";
+    Generator rows(config), rules(rule_config), one(config), two(config);
+    std::string a, b;
+    rows.Row(a);
+    rules.Rule(b);
+    fail.Check(a == "{\"a1\": 814, \"a2\": \"v103\", \"a3\": 837}" && b == "a3 >= 688", "first row and rule of seed 3");
+    bool same = true;
+    for (int i = 0; i < 100; ++i) {
+        one.Row(a);
+        two.Row(b);
+        same = same && a == b;
+        one.Rule(a);
+        two.Rule(b);
+        same = same && a == b;
+    }
+    fail.Check(same, "rows and rules of one seed");
+}
+
+// PredicateCounters: rows counted over two shards come to the rule's
+// outcomes as Reference has them, and no predicate is evaluated more often
+// than the rule. A program parsed anew and grown past the shards still
+// matches but is not counted.
+void Counteds(const vector<Case> &cases, const Rows &rows, Failures &fail) {
+    for (const Case &c: cases) {
+        Expressions exp;
+        exp.Parse(c.rule.c_str());
+        PredicateCounters counters(exp, 2);
+        Expressions::Context ctx[2];
+        counters.Attach(ctx[0], 0);
+        counters.Attach(ctx[1], 1);
+        uint64_t falses = 0;
+        for (size_t i = 0; i < rows.props.size(); ++i) {
+            fail.Check(exp.Match(rows.props[i], ctx[i % 2]) == c.expected[i], "counted", c.rule, i);
+            falses += !c.expected[i];
+        }
+        PredicateCounters::Snapshot snapshot;
+        counters.Read(snapshot);
+        bool ok = snapshot.rule.evals == rows.props.size() && snapshot.rule.falses == falses;
+        for (const PredicateCounters::Predicate &predicate: snapshot.predicates)
+            ok = ok && predicate.count.evals <= snapshot.rule.evals &&
+                 predicate.count.trues + predicate.count.falses <= predicate.count.evals;
+        fail.Check(ok, "counts of '" + c.rule + "'");
+    }
+
+    Expressions exp;
+    exp.Parse("a > 1");
+    PredicateCounters counters(exp, 1);
+    Expressions::Context ctx;
+    counters.Attach(ctx, 0);
+    std::string rule = "a > 1";
+    for (int i = 0; i < 64; ++i)
+        rule += " & b" + std::to_string(i) + " < " + std::to_string(i);
+    exp.Parse(rule.c_str());
+    vector<Prop> row{Int("a", 2)};
+    bool matched = exp.Match(row, ctx);
+    PredicateCounters::Snapshot snapshot;
+    counters.Read(snapshot);
+    fail.Check(matched && snapshot.rule.evals == 0, "a program grown past its counters");
+}
+
+// LatencyRecorder: durations spread over powers of two, recorded by three
+// threads, give each quantile at or above the exact one by at most 1/2^Sub
+// of it; buckets tile the values; one call in every is sampled
+void Latencies(Failures &fail) {
+    const int n = 30000;
+    std::mt19937 rng(7);
+    vector<uint64_t> values;
+    for (int i = 0; i < n; ++i)
+        values.push_back((uint64_t)1 << rng() % 40 | rng() % 1024);
+    bool tiled = true;
+    for (size_t b = 0; b + 1 < Histogram::Buckets; ++b)
+        tiled = tiled && Histogram::Index(Histogram::High(b)) == b && Histogram::Index(Histogram::High(b) + 1) == b + 1;
+    for (const uint64_t &v: values) {
+        uint64_t high = Histogram::High(Histogram::Index(v));
+        tiled = tiled && v <= high && high - v <= v >> Histogram::Sub;
+    }
+    fail.Check(tiled, "histogram buckets");
+
+    LatencyRecorder latency(3);
+    vector<std::thread> threads;
+    for (size_t t = 0; t < 3; ++t)
+        threads.emplace_back([&, t] {
+            for (size_t i = t; i < values.size(); i += 3)
+                latency.Record(t, values[i]);
+        });
+    for (std::thread &thread: threads)
+        thread.join();
+    std::unique_ptr<Histogram> merged(new Histogram());
+    latency.Merge(*merged);
+    uint64_t sum = 0;
+    for (const uint64_t &v: values)
+        sum += v;
+    bool ok = merged->Count() == values.size() && merged->Sum() == sum;
+    std::sort(values.begin(), values.end());
+    for (const double &q: {0.5, 0.9, 0.99, 0.999, 1.0}) {
+        uint64_t exact = values[std::max(1, std::min(n, (int)(q * n + 0.5))) - 1];
+        uint64_t got = merged->Quantile(q);
+        ok = ok && got >= exact && got - exact <= exact >> Histogram::Sub;
+    }
+    std::string text;
+    latency.Text("match_seconds", "Match latency", text);
+    ok = ok && text.find("match_seconds_count " + std::to_string(n) + "\n") != std::string::npos;
+    fail.Check(ok, "histogram quantiles");
+
+    LatencyRecorder sampled(1, 4);
+    int timed = 0;
+    for (int i = 0; i < 400; ++i)
+        timed += sampled.Sample(0);
+    fail.Check(timed == 100, "one call in 4 sampled");
+}
+
+// Rules nesting 10^4 alternating '|' and '&', and 10^5 brackets
+void Depths(Failures &fail) {
+    const int n = 10000;
+    // '|' and '&' bind alike, left to right: (a > i | b < 3) & (...), so the
+    // rule holds where a > n
+    std::string rule;
+    for (int i = 0; i < n; ++i)
+        rule += "a > " + std::to_string(i) + " | b < 3 & (";
+    rule += "a > " + std::to_string(n) + std::string(n, ')');
+    Expressions exp;
+    Compile(exp, rule, "a rule nesting '|' and '&' 10^4 deep", fail);
+    Expressions::Context ctx;
+    fail.Check(exp.Match(vector<Prop>{Int("a", n + 1), Int("b", 5)}, ctx) &&
+               !exp.Match(vector<Prop>{Int("a", n), Int("b", 5)}, ctx) &&
+               !exp.Match(vector<Prop>{Int("a", n / 2), Int("b", 1)}, ctx),
+               "a rule nesting '|' and '&' 10^4 deep");
+    Jit jit(exp.Compiled());
+    exp.Load(vector<Prop>{Int("a", n + 1), Int("b", 5)}, ctx);
+    fail.Check(jit.Run(ctx.slots.data(), ctx.regs.data()).ans == Expression::True, "jit 10^4 deep");
+    vector<vector<Prop>> rows{{}, {Int("b", 1)}, {Int("a", 0)}};
+    for (int a: {0, n / 2, n - 1, n, n + 1})
+        for (int b: {1, 3, 5})
+            rows.push_back({Int("a", a), Int("b", b)});
+    Agree(rule, rows, "10^4 deep", fail);
+
+    std::string brackets = std::string(10 * n, '(') + "a > 1" + std::string(10 * n, ')');
+    Compile(exp, brackets, "a rule in 10^5 brackets", fail);
+    fail.Check(exp.Match(vector<Prop>{Int("a", 2)}) && !exp.Match(vector<Prop>{Int("a", 1)}),
+               "a rule in 10^5 brackets");
+    Agree(brackets, vector<vector<Prop>>{{}, {Int("a", 1)}, {Int("a", 2)}, {Float("a", 1.5f)}}, "10^5 brackets", fail);
+}
+
+int main(int argc, char **argv) {
+    uint32_t seed = 1;
+    if (argc == 3 && strcmp(argv[1], "--seed") == 0) {
+        seed = (uint32_t)std::stoul(argv[2]);
+    } else if (argc != 1) {
+        std::cerr << "usage: " << argv[0] << " [--seed n]" << std::endl;
+        return 2;
+    }
+    Failures fail;
+
+    // Few values of few bytes, so '=' on strings hits and columns repeat
+    const char *schema[] = {"--attrs", "8", "--strings", "0.5", "--card", "20", "--strlen", "2",
+                            "--presence", "0.7"};
+    std::string seed_text = std::to_string(seed);
+    Rows rows;
+    {
+        vector<const char *> args{"gen", "rows", "--seed", seed_text.c_str(), "--count", "2000"};
+        args.insert(args.end(), std::begin(schema), std::end(schema));
+        Config config;
+        bool ok = config.Parse((int)args.size(), (char **)args.data());
+        assert(ok);
+        (void)ok;
+        Generator gen(config);
+        std::string line;
+        for (size_t i = 0; i < config.count; ++i) {
+            gen.Row(line);
+            rows.Add(line);
+        }
+    }
+    vector<std::string> rules;
+    for (const char *op: {"and", "or", "mixed"}) {
+        vector<const char *> args{"gen", "rules", "--seed", seed_text.c_str(), "--count", "60", "--preds", "6",
+                                  "--op", op, "--sel", "0.05:0.9"};
+        args.insert(args.end(), std::begin(schema), std::end(schema));
+        Config config;
+        bool ok = config.Parse((int)args.size(), (char **)args.data());
+        assert(ok);
+        (void)ok;
+        Generator gen(config);
+        std::string line;
+        for (size_t i = 0; i < config.count; ++i) {
+            gen.Rule(line);
+            rules.push_back(line);
+        }
+    }
+    // What gen does not write: every operator on every type, parameter
+    // against parameter, Bool compares, bare values, constants, constant
+    // first. $i and $j stand for attributes of ints, $s and $t of strings.
+    for (const char *rule: {"$i > 7 | $i <= 3", "$i = 4 | $i < 2", "$j > 7.5 | $j <= 3.5 & $j = 5.0",
+                            "$j < 2.5 | $j >= 6.5", "$s < 'v3' | $s >= 'v7'", "$s > 'v2' & $s <= 'v9'",
+                            "$s = 'v1' | $t < 'v1'", "$i = $j", "$s = $t", "$i < $j | $s >= $t", "$i < $s",
+                            "($i < 3) = ($j < 4)", "($i < 3 | $s = 'v0') = ($j > 4)", "$i", "$i & $j < 3",
+                            "$s | $i > 4", "5 > $i & 'v1' = $s", "1 = 1", "1 = 2 | $i < 4", "2 < 1 & $j < 4",
+                            "$i >= 2 & $i < 9 & $i > 3", "$j > 2.5 & $j <= 12 | $i < 1", "$s >= 'v1' & $s < 'v5'"})
+        rules.push_back(Fill(rule, rows));
+
+    vector<Case> cases;
+    for (const std::string &rule: rules)
+        cases.emplace_back(rule, rows);
+
+    // In the order of the changes they cover
+    Programs(cases, rows, fail);
+    ShortCircuits(fail);
+    Saxes(cases, rows, fail);
+    RuleSets(cases, rows, fail);
+    Batches(cases, rows, fail);
+    Simds(cases, rows, fail);
+    Slots(fail);
+    Widths(fail);
+    Prefilters(fail);
+    Simplifies(rows, fail);
+    Chains(fail);
+    Adapts(cases, rows, fail);
+    Ranges(fail);
+    Collisions(fail);
+    Hashes<PolyHash>("PolyHash", fail);
+    Hashes<WordHash>("WordHash", fail);
+    Statics<Static0>(Static0Text::Str(), rows, fail);
+    Statics<Static1>(Static1Text::Str(), rows, fail);
+    Statics<Static2>(Static2Text::Str(), rows, fail);
+    Statics<Static3>(Static3Text::Str(), rows, fail);
+    Statics<Static4>(Static4Text::Str(), rows, fail);
+    Statics<Static5>(Static5Text::Str(), rows, fail);
+    Jits(cases, rows, fail);
+    Depths(fail);
+    Shares(cases, rows, fail);
+    Parallels(cases, rows, fail);
+    Lines(cases, rows, fail);
+    Decides(cases, rows, fail);
+    Gens(fail);
+    Counteds(cases, rows, fail);
+    Latencies(fail);
+    std::cout << "differential: " << rules.size() << " rules, " << rows.props.size() << " rows, seed " << seed
+              << std::endl;
+
+    std::cout << (fail.Count() == 0 ? "ok" : std::to_string(fail.Count()) + " failures") << std::endl;
+    return fail.Count() == 0 ? 0 : 1;
+}